@@ -0,0 +1,71 @@
+#include "expression.h"
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Parse throughput of `expression::parse` on long and deeply nested
+// formulas. Run with `make bench`. Only `expression::parse` is used, so the
+// same file also builds against older parsers for comparison.
+
+namespace {
+    struct bench_case {
+        std::string name;
+        std::string text;
+    };
+
+    std::string sum_of_cells(int n) {
+        std::string text = "A1";
+        for (int i=2; i<=n; ++i) text += "+A" + std::to_string(i);
+        return text;
+    }
+
+    std::string nested_brackets(int depth) {
+        return std::string(depth, '(') + "1" + std::string(depth, ')');
+    }
+
+    std::string sum_function(int n) {
+        std::string text = "SUM(A1";
+        for (int i=2; i<=n; ++i) text += ",A" + std::to_string(i);
+        return text + ")";
+    }
+
+    /**
+     * Returns the number of parses of `text` per second, parsing it
+     * repeatedly for at least `seconds`.
+     */
+    double parses_per_second(const std::string& text, double seconds) {
+        using clock = std::chrono::steady_clock;
+        const clock::time_point start = clock::now();
+        long long count = 0;
+        double elapsed;
+        do {
+            for (int i=0; i<16; ++i) expression::parse(text);
+            count += 16;
+            elapsed = std::chrono::duration<double>(clock::now() - start).count();
+        } while (elapsed < seconds);
+        return count / elapsed;
+    }
+}
+
+int main() {
+    const std::vector<bench_case> cases = {
+        { "A1+A2+...+A500", sum_of_cells(500) },
+        { "100 nested brackets", nested_brackets(100) },
+        { "SUM of 200 refs", sum_function(200) },
+        { "IF(A1<B2,A1*2,\"x\")", "IF(A1<B2,A1*2,\"x\")" },
+    };
+    std::printf("%-22s %12s\n", "formula", "parses/s");
+    for (const bench_case& c : cases) {
+        std::printf("%-22s %12.0f\n", c.name.c_str(), parses_per_second(c.text, 0.5));
+    }
+
+    // A linear parser spends the same time per character at every length.
+    std::printf("\n%-22s %12s %12s\n", "A1+...+An", "us/parse", "ns/char");
+    for (int n = 125; n <= 2000; n *= 2) {
+        const std::string text = sum_of_cells(n);
+        const double per_parse = 1 / parses_per_second(text, 0.25);
+        std::printf("n = %-18d %12.1f %12.1f\n", n, per_parse * 1e6, per_parse * 1e9 / text.size());
+    }
+    return 0;
+}
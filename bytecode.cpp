@@ -0,0 +1,110 @@
+#include "bytecode.h"
+#include "worksheet.h"
+
+void expression::primitive::compile(bytecode& code) const {
+    code.constants.push_back(to_value());
+    code.emit(bytecode::opcode::push_constant, code.constants.size() - 1);
+}
+
+void expression::reference::compile(bytecode& code) const {
+    code.cells.push_back(ref);
+    code.emit(bytecode::opcode::load_cell, code.cells.size() - 1);
+}
+
+void expression::range::compile(bytecode& code) const {
+    code.constants.push_back(value::of_range(ref));
+    code.emit(bytecode::opcode::push_constant, code.constants.size() - 1);
+}
+
+void expression::function::compile(bytecode& code) const {
+    if (bind_error) {
+        code.emit(bytecode::opcode::push_error, (uint32_t)*bind_error);
+        return;
+    }
+    if (def->impl == nullptr) {
+        // IF: condition; jump_unless_boolean end; jump_if_false else; then; jump end; else: else; end:
+        arg[0]->compile(code);
+        size_t check = code.emit(bytecode::opcode::jump_unless_boolean);
+        size_t jump_else = code.emit(bytecode::opcode::jump_if_false);
+        arg[1]->compile(code);
+        size_t jump_end = code.emit(bytecode::opcode::jump);
+        code.depth--; // only one branch is left on the stack
+        code.code[jump_else].operand = code.code.size();
+        arg[2]->compile(code);
+        code.code[jump_end].operand = code.code.size();
+        code.code[check].operand = code.code.size();
+        return;
+    }
+
+    for (const std::shared_ptr<expression>& exp : arg) {
+        exp->compile(code);
+    }
+    code.functions.push_back(def->impl);
+    code.emit(bytecode::opcode::call, code.functions.size() - 1, arg.size());
+}
+
+expression::bytecode expression::bytecode::compile(const expression& expr) {
+    bytecode code;
+    expr.compile(code);
+    return code;
+}
+
+size_t expression::bytecode::emit(opcode op, uint32_t operand, uint16_t argc) {
+    switch (op) {
+        case opcode::push_constant:
+        case opcode::load_cell:
+        case opcode::push_error: depth++; break;
+        case opcode::call: depth = depth - argc + 1; break;
+        case opcode::jump_if_false: depth--; break;
+        case opcode::jump_unless_boolean:
+        case opcode::jump: break;
+    }
+    max_stack = std::max(max_stack, depth);
+    code.push_back({ op, argc, operand });
+    return code.size() - 1;
+}
+
+expression::eval_expr expression::bytecode::run(context& ctx) const {
+    std::vector<eval_expr>& stack = ctx.scratch;
+    const size_t bottom = stack.size();
+    stack.reserve(bottom + max_stack);
+    for (size_t pc = 0; pc < code.size(); ) {
+        const instruction& ins = code[pc++];
+        switch (ins.op) {
+            case opcode::push_constant:
+                stack.push_back(constants[ins.operand]);
+                break;
+            case opcode::load_cell:
+                stack.push_back(ctx.sheet.value_at(cells[ins.operand]));
+                break;
+            case opcode::call: {
+                size_t base = stack.size() - ins.argc;
+                eval_expr res = functions[ins.operand](ctx, stack.data() + base, ins.argc);
+                stack.resize(base);
+                stack.push_back(std::move(res));
+                break;
+            }
+            case opcode::jump_unless_boolean:
+                if (!stack.back().is_type<boolean>()) {
+                    stack.back() = function::if_condition_error(stack.back());
+                    pc = ins.operand;
+                }
+                break;
+            case opcode::jump_if_false: {
+                bool condition = stack.back().boolean_raw;
+                stack.pop_back();
+                if (!condition) pc = ins.operand;
+                break;
+            }
+            case opcode::jump:
+                pc = ins.operand;
+                break;
+            case opcode::push_error:
+                stack.push_back(value::of_error((error::values)ins.operand));
+                break;
+        }
+    }
+    eval_expr res = std::move(stack.back());
+    stack.resize(bottom);
+    return res;
+}
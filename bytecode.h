@@ -0,0 +1,67 @@
+#ifndef __INCLUDE_BYTECODE_
+#define __INCLUDE_BYTECODE_
+
+#include "expression.h"
+#include <cstdint>
+#include <vector>
+
+/**
+ * A formula lowered to a flat instruction stream and executed by a stack machine.
+ *
+ * This is the compiled alternative to walking the expression tree with
+ * `expression::evaluate`, giving the same results.
+ */
+struct expression::bytecode {
+    enum struct opcode: uint8_t {
+        /// Push `constants[operand]`.
+        push_constant,
+        /// Push the calculated value of `cells[operand]`.
+        load_cell,
+        /// Pop `argc` values and push the result of `functions[operand]` applied to them.
+        call,
+        /// If the condition on top is not a boolean, replace it with the result of
+        /// `function::if_condition_error` and jump to `operand`.
+        jump_unless_boolean,
+        /// Pop a boolean condition and jump to `operand` if it is false.
+        jump_if_false,
+        /// Jump to `operand`.
+        jump,
+        /// Push the error with value `operand`.
+        push_error,
+    };
+    struct instruction {
+        opcode op;
+        uint16_t argc;
+        uint32_t operand;
+    };
+
+    std::vector<instruction> code;
+    std::vector<eval_expr> constants;
+    std::vector<worksheet_reference::cell_reference> cells;
+    std::vector<function::raw> functions;
+    /// Maximum size of the value stack while running.
+    size_t max_stack = 0;
+    /// Size of the value stack after the emitted instructions, used while compiling.
+    size_t depth = 0;
+
+    /**
+     * Lower an expression tree into bytecode.
+     */
+    static bytecode compile(const expression& expr);
+
+    /**
+     * Run the instructions and return the value left on the stack.
+     *
+     * The stack lives on `ctx.scratch`.
+     */
+    eval_expr run(context& ctx) const;
+
+    /**
+     * Append an instruction, keeping track of the stack size.
+     *
+     * @returns Index of the appended instruction.
+     */
+    size_t emit(opcode op, uint32_t operand = 0, uint16_t argc = 0);
+};
+
+#endif
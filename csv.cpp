@@ -0,0 +1,184 @@
+#include "csv.h"
+#include "mapped_file.h"
+#include <algorithm>
+#include <thread>
+
+char csv::delimiter_of(const std::string& path) noexcept {
+    const std::string extension = ".tsv";
+    if (path.size() >= extension.size() && path.compare(path.size() - extension.size(), extension.size(), extension) == 0) return '\t';
+    return ',';
+}
+
+namespace {
+    /**
+     * Records of a file parsed by one thread.
+     */
+    struct chunk {
+        const char* begin = nullptr;
+        const char* end = nullptr;
+        /// Cells parsed, with rows counted from the first record of the chunk.
+        std::vector<std::unique_ptr<worksheet::cell>> cells;
+        /// Fields which failed to parse and the parse error messages, with rows counted the same way.
+        std::vector<std::pair<worksheet::cell_reference, std::string>> errors;
+        /// Number of records.
+        int rows = 0;
+    };
+
+    /**
+     * Call `f(i)` for every `i < n` on a thread of its own, the first one
+     * on the calling thread.
+     */
+    template<typename F>
+    void run_parallel(size_t n, F f) {
+        std::vector<std::thread> threads;
+        for (size_t i=1; i<n; ++i) threads.emplace_back(f, i);
+        f(0);
+        for (std::thread& thread : threads) thread.join();
+    }
+
+    /**
+     * Parse the records of a chunk starting at a record boundary into cells.
+     *
+     * Every quote switches between quoted and unquoted text, except a doubled
+     * quote inside quotes which stands for one quote. So whether a position
+     * is quoted only depends on the parity of the quotes before it, which is
+     * how the chunks are split.
+     */
+    void parse(chunk& c, char delimiter) {
+        int row = 0, col = 0;
+        std::string field;
+        auto end_field = [&]() {
+            if (!field.empty() && col < worksheet::MAX_COL) {
+                auto parsed = std::make_unique<worksheet::cell>(worksheet::cell_reference(row, col));
+                try {
+                    parsed->set_raw(field);
+                    c.cells.push_back(std::move(parsed));
+                } catch (const expression::parse_exception& e) {
+                    c.errors.push_back({ parsed->ref, e.what() });
+                }
+            }
+            field.clear();
+            col++;
+        };
+
+        bool quoted = false;
+        for (const char* p = c.begin; p < c.end; ++p) {
+            if (*p == '"') {
+                if (quoted && p+1 < c.end && p[1] == '"') field += *++p;
+                else quoted = !quoted;
+            } else if (quoted) {
+                field += *p;
+            } else if (*p == delimiter) {
+                end_field();
+            } else if (*p == '\n' || *p == '\r') {
+                end_field();
+                if (*p == '\r' && p+1 < c.end && p[1] == '\n') ++p;
+                row++;
+                col = 0;
+            } else {
+                // Append the run of plain characters at once.
+                const char* q = p;
+                while (q < c.end && *q != '"' && *q != delimiter && *q != '\n' && *q != '\r') ++q;
+                field.append(p, q);
+                p = q - 1;
+            }
+        }
+        // The last record may lack a line break.
+        if (col != 0 || !field.empty()) {
+            end_field();
+            row++;
+        }
+        c.rows = row;
+    }
+}
+
+size_t csv::read(worksheet& sheet, const std::string& path, std::ostream& errors) {
+    const mapped_file file(path);
+    const char delimiter = delimiter_of(path);
+
+    // Below this many bytes per thread, starting threads costs more than it saves.
+    const size_t min_chunk_size = 1 << 20;
+    const size_t n = std::max<size_t>(1, std::min<size_t>(worksheet::thread_count, file.size / min_chunk_size));
+    auto nominal_start = [&](size_t i) { return file.size * i / n; };
+
+    // Split into chunks at the first line break after each nominal start
+    // which is not quoted, knowing from the quotes before it.
+    std::vector<size_t> quotes(n);
+    run_parallel(n, [&](size_t i) {
+        quotes[i] = std::count(file.data + nominal_start(i), file.data + nominal_start(i+1), '"');
+    });
+    std::vector<chunk> chunks(n);
+    size_t start = 0, quotes_before = 0;
+    for (size_t i=0; i<n; ++i) {
+        if (i > 0) {
+            bool quoted = quotes_before % 2 == 1;
+            size_t p = nominal_start(i);
+            for (; p < file.size; ++p) {
+                if (file.data[p] == '"') quoted = !quoted;
+                else if (file.data[p] == '\n' && !quoted) break;
+            }
+            start = std::max(start, std::min(p + 1, file.size));
+        }
+        chunks[i].begin = file.data + start;
+        if (i > 0) chunks[i-1].end = chunks[i].begin;
+        quotes_before += quotes[i];
+    }
+    chunks[n-1].end = file.data + file.size;
+
+    run_parallel(n, [&](size_t i) { parse(chunks[i], delimiter); });
+
+    size_t failed = 0;
+    int first_row = 0;
+    for (chunk& c : chunks) {
+        for (std::unique_ptr<worksheet::cell>& parsed : c.cells) {
+            const worksheet::cell_reference ref(first_row + parsed->ref.row.number, parsed->ref.col.number);
+            if (!worksheet::contains(ref)) continue;
+            parsed->ref = ref;
+            sheet.load_cell(std::move(parsed));
+        }
+        for (const auto& [local, message] : c.errors) {
+            errors << worksheet::cell_reference(first_row + local.row.number, local.col.number).to_code() << ": " << message << std::endl;
+            failed++;
+        }
+        first_row += c.rows;
+    }
+    return failed;
+}
+
+namespace {
+    void write_field(std::ostream& out, const std::string& field, char delimiter) {
+        if (field.find_first_of(std::string("\"\r\n") + delimiter) == std::string::npos) {
+            out << field;
+            return;
+        }
+        out << '"';
+        for (char c : field) {
+            if (c == '"') out << '"';
+            out << c;
+        }
+        out << '"';
+    }
+}
+
+void csv::write(const worksheet& sheet, std::ostream& out, char delimiter) {
+    int last_row = -1, last_col = -1;
+    sheet.cells.for_each_tile([&](worksheet::tile& t) {
+        for (const std::unique_ptr<worksheet::cell>& c : t.cells) {
+            if (!c || c->raw.empty()) continue;
+            last_row = std::max(last_row, c->ref.row.number);
+            last_col = std::max(last_col, c->ref.col.number);
+        }
+    });
+
+    for (int row=0; row<=last_row; ++row) {
+        for (int col=0; col<=last_col; ++col) {
+            if (col != 0) out << delimiter;
+            // Texts which would be read back as something else are marked
+            // with an apostrophe, like a text entered as `'=1`.
+            const expression::value value = sheet.value_at(worksheet::cell_reference(row, col));
+            if (value.is_type<expression::text>()) write_field(out, worksheet::cell::raw_of_text(value.text_raw), delimiter);
+            else write_field(out, value.to_string(), delimiter);
+        }
+        out << '\n';
+    }
+}
@@ -0,0 +1,49 @@
+#ifndef __INCLUDE_CSV_
+#define __INCLUDE_CSV_
+
+#include "worksheet.h"
+#include <iostream>
+#include <string>
+
+/**
+ * Reading and writing worksheets as comma-separated values (RFC 4180), or
+ * tab-separated values for files ending with `.tsv`.
+ *
+ * The first record is row 1 and the first field of a record is column A.
+ * Fields containing delimiters, quotes or line breaks are quoted, with
+ * quotes doubled inside.
+ */
+namespace csv {
+    /**
+     * Delimiter of the fields of a file, a tab for `.tsv` files and a comma
+     * otherwise.
+     */
+    char delimiter_of(const std::string& path) noexcept;
+
+    /**
+     * Load the raw text of cells from a file without recalculating them.
+     *
+     * The file is mapped into memory and split into chunks on record
+     * boundaries, which are parsed on `worksheet::thread_count` threads.
+     * Only linking the parsed cells into the worksheet is serial.
+     *
+     * Empty fields are skipped. A field which is a formula that cannot be
+     * parsed is reported to `errors` and skipped too.
+     *
+     * @throws std::system_error Thrown if the file cannot be read.
+     * @returns Number of fields skipped because of parse errors.
+     */
+    size_t read(worksheet& sheet, const std::string& path, std::ostream& errors) noexcept(false);
+
+    /**
+     * Write the calculated values of the cells from A1 to the last row and
+     * column holding a cell.
+     *
+     * Texts which `read` would load as integers or formulas, or which start
+     * with an apostrophe, are written with an apostrophe before them so they
+     * are read back as the same texts.
+     */
+    void write(const worksheet& sheet, std::ostream& out, char delimiter = ',');
+}
+
+#endif
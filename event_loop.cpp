@@ -0,0 +1,90 @@
+#include "event_loop.h"
+#include <algorithm>
+#include <cerrno>
+#include <system_error>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+event_loop::event_loop(int max_fps, handler render):
+    frame_interval(1000 / std::max(max_fps, 1)), render(std::move(render)) {}
+
+void event_loop::watch(int fd, handler on_readable) {
+    watched.push_back({ fd, std::move(on_readable) });
+}
+
+int event_loop::add_timer(handler on_expiry) {
+    timers.push_back({ std::nullopt, std::move(on_expiry) });
+    return timers.size() - 1;
+}
+
+void event_loop::start_timer(int timer, int delay_ms) {
+    timers[timer].deadline = clock::now() + std::chrono::milliseconds(delay_ms);
+}
+
+void event_loop::stop_timer(int timer) noexcept {
+    timers[timer].deadline.reset();
+}
+
+void event_loop::request_render() noexcept {
+    render_requested = true;
+}
+
+void event_loop::run() {
+    std::vector<pollfd> fds;
+    while (true) {
+        clock::time_point now = clock::now();
+        for (size_t i=0; i<timers.size(); ++i) {
+            if (!timers[i].deadline || *timers[i].deadline > now) continue;
+            timers[i].deadline.reset();
+            // Copied since the handler may add timers.
+            handler on_expiry = timers[i].on_expiry;
+            on_expiry();
+        }
+        if (render_requested && now >= last_render + frame_interval) {
+            render_requested = false;
+            last_render = now;
+            render();
+        }
+
+        // Sleep until the next timer or the end of the frame interval of a
+        // pending render, unless a descriptor is readable before.
+        std::optional<clock::time_point> wake_up;
+        for (const timer_entry& t : timers) {
+            if (t.deadline && (!wake_up || *t.deadline < *wake_up)) wake_up = t.deadline;
+        }
+        if (render_requested && (!wake_up || last_render + frame_interval < *wake_up)) wake_up = last_render + frame_interval;
+        int timeout_ms = -1;
+        if (wake_up) {
+            now = clock::now();
+            // Rounded up so the loop does not spin until the deadline.
+            timeout_ms = *wake_up <= now ? 0 : std::chrono::ceil<std::chrono::milliseconds>(*wake_up - now).count();
+        }
+
+        fds.clear();
+        for (const watched_fd& w : watched) fds.push_back({ w.fd, POLLIN, 0 });
+        if (poll(fds.data(), fds.size(), timeout_ms) <= 0) continue;
+        for (size_t i=0; i<fds.size(); ++i) {
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) watched[i].on_readable();
+        }
+    }
+}
+
+event_loop::notifier::notifier() {
+    fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0) throw std::system_error(errno, std::generic_category(), "eventfd");
+}
+
+event_loop::notifier::~notifier() {
+    close(fd);
+}
+
+void event_loop::notifier::notify() noexcept {
+    const uint64_t one = 1;
+    if (write(fd, &one, sizeof one) < 0) {} // Only fails when the counter is full, still readable.
+}
+
+void event_loop::notifier::clear() noexcept {
+    uint64_t count;
+    if (read(fd, &count, sizeof count) < 0) {} // Not readable already.
+}
@@ -0,0 +1,104 @@
+#ifndef __INCLUDE_EVENT_LOOP_
+#define __INCLUDE_EVENT_LOOP_
+
+#include <chrono>
+#include <functional>
+#include <optional>
+#include <vector>
+
+/**
+ * Loop of the user interface, waiting with `poll` for file descriptors to
+ * become readable or timers to expire and calling their handlers.
+ *
+ * Handlers do not render themselves but call `request_render`. The requests
+ * are coalesced into at most one render per `frame_interval`, so a burst of
+ * events costs a single frame and an idle loop costs nothing.
+ */
+class event_loop {
+    public:
+        using handler = std::function<void()>;
+        struct notifier;
+
+        /// Shortest time between the start of two renders.
+        const std::chrono::milliseconds frame_interval;
+
+        /**
+         * @param max_fps Maximum number of renders per second.
+         * @param render Called to render after `request_render`.
+         */
+        event_loop(int max_fps, handler render);
+
+        /**
+         * Call `on_readable` whenever `fd` is readable. The handler must read
+         * from `fd`, or it is called again right away.
+         */
+        void watch(int fd, handler on_readable);
+        /**
+         * Add a timer, stopped until `start_timer`.
+         *
+         * @returns Identifier of the timer.
+         */
+        int add_timer(handler on_expiry);
+        /**
+         * Call the handler of a timer once after `delay_ms` milliseconds,
+         * replacing the previous deadline if it is already started.
+         */
+        void start_timer(int timer, int delay_ms);
+        void stop_timer(int timer) noexcept;
+
+        /**
+         * Render before waiting again, or when the frame interval since the
+         * last render ends.
+         */
+        void request_render() noexcept;
+
+        /**
+         * Handle events forever.
+         */
+        [[noreturn]] void run();
+    private:
+        using clock = std::chrono::steady_clock;
+
+        struct watched_fd {
+            int fd;
+            handler on_readable;
+        };
+        struct timer_entry {
+            std::optional<clock::time_point> deadline;
+            handler on_expiry;
+        };
+
+        handler render;
+        std::vector<watched_fd> watched;
+        std::vector<timer_entry> timers;
+        bool render_requested = true;
+        clock::time_point last_render;
+};
+
+/**
+ * An event file descriptor which other threads write to in order to wake up
+ * an `event_loop` watching it.
+ */
+struct event_loop::notifier {
+    int fd;
+
+    /**
+     * @throws std::system_error Thrown if the descriptor cannot be created.
+     */
+    notifier() noexcept(false);
+    notifier(const notifier&) = delete;
+    notifier& operator=(const notifier&) = delete;
+    ~notifier();
+
+    /**
+     * Make `fd` readable. This may be called from any thread, and from a
+     * signal handler.
+     */
+    void notify() noexcept;
+    /**
+     * Read every notification so far, making `fd` not readable again.
+     */
+    void clear() noexcept;
+};
+
+#endif
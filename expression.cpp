@@ -1,10 +1,9 @@
 #include "expression.h"
 #include "worksheet.h"
-#include "workspace.h"
+#include "simd.h"
 #include <algorithm>
 #include <functional>
 #include <numeric>
-#include <boost/algorithm/string/trim.hpp>
 
 template<class exp>
 std::ostream& operator<<(std::ostream& os, const std::shared_ptr<exp> self) {
@@ -15,226 +14,339 @@ std::ostream& operator<<(std::ostream& os, const std::shared_ptr<exp> self) {
 bool is_letter_or_underscore(char x) {
     return (x >= 'A' && x <= 'Z') || (x >= 'a' && x <= 'z') || (x == '_');
 }
-int get_precedence(std::string op) {
-    if (op == "*" || op == "/") return 3;
-    if (op == "+" || op == "-") return 2;
-    if (op == "&") return 1;
-    if (op == "=" || op == "<>" || op == "<" || op == ">" || op == "<=" || op == ">=") return 0;
-    return -1;
-}
-bool is_unary(std::string op) {
-    return op == "+" || op == "-";
-}
-expression::parse_expr expression::parse(const std::string& str) {
-    // expression := -------- constant --------|
-    //                 |----- integer ---|
-    //                 |----- text ------|
-    //                 |----- bracket ---|
-    //                 |----- operator --|
-    //                 |- function call -|
-    //                 ---- reference ----
-    // integer := --- (no exception by stoll) --|
-    // text := ---- " -------------------------- " ---|
-    //                 |                      |
-    //                 -- character except " --
-    // bracket := --- ( --- expression --- ) -----|
-    // operator := --- expression --- op ----- expression ----|
-    // function call := ----- identifier --- ( ------------------------------------- ) -----|
-    //                                          |                                 |
-    //                                          -- expression ------<-------------
-    //                                                         |                  |
-    //                                                         -- , -- expression |
-    // identifier := --- A-Z ---------------------|
-    //                |- a-z -|   |-- A-Z --|
-    //                --- _ ---   |-- a-z --|
-    //                            |--- _ ---|
-    //                            |-- 0-9 --|
-    // reference := ------ A-Z, a-z ------------ 1-9 ------------------|
-    //                 |              |                 |            |
-    //                 ------<---------                 -- 0-9 ---<---
-
-    std::string trimmed = boost::trim_copy(str);
-    if (trimmed.empty()) throw parse_exception(str, "empty expresion");
-
-    std::string upper_trimmed = trimmed;
-    for (char& c : upper_trimmed) c = toupper(c);
-    if (upper_trimmed == "TRUE") return std::make_shared<boolean>(true);
-    if (upper_trimmed == "FALSE") return std::make_shared<boolean>(false);
-
-    // string
-    if (trimmed[0] == '"' && trimmed[trimmed.length()-1] == '"' && std::count(trimmed.begin(), trimmed.end(), '"') == 2) {
-        return std::make_shared<expression::text>(trimmed.substr(1, trimmed.length()-2));
+bool is_digit(char x) {
+    return x >= '0' && x <= '9';
+}
+
+/**
+ * A lexical token of an expression text.
+ */
+struct token {
+    enum struct type_id { integer, text, identifier, op, open_bracket, close_bracket, comma, colon, end } type;
+    /// Index of the first character of the token in the expression text.
+    size_t begin;
+    /// Index past the last character of the token in the expression text.
+    size_t end;
+};
+
+/**
+ * Split an expression text into tokens in a single pass.
+ *
+ * The returned stream always ends with a token of type `end`.
+ *
+ * @throws expresion::parse_exception Thrown if the text contains an unterminated
+ *     text or an unexpected character.
+ */
+std::vector<token> tokenize(const std::string& str) noexcept(false) {
+    std::vector<token> tokens;
+    size_t i = 0;
+    while (true) {
+        while (i < str.size() && isspace((unsigned char)str[i])) ++i;
+        if (i == str.size()) break;
+
+        size_t begin = i;
+        char ch = str[i];
+        token::type_id type;
+        if (is_digit(ch)) {
+            while (i < str.size() && is_digit(str[i])) ++i;
+            type = token::type_id::integer;
+        } else if (is_letter_or_underscore(ch)) {
+            while (i < str.size() && (is_letter_or_underscore(str[i]) || is_digit(str[i]))) ++i;
+            type = token::type_id::identifier;
+        } else if (ch == '"') {
+            i = str.find('"', i + 1);
+            if (i == std::string::npos) throw expression::parse_exception(str, "text unterminated");
+            ++i;
+            type = token::type_id::text;
+        } else if (ch == '(') {
+            ++i;
+            type = token::type_id::open_bracket;
+        } else if (ch == ')') {
+            ++i;
+            type = token::type_id::close_bracket;
+        } else if (ch == ',') {
+            ++i;
+            type = token::type_id::comma;
+        } else if (ch == ':') {
+            ++i;
+            type = token::type_id::colon;
+        } else if (ch == '<' && i+1 < str.size() && (str[i+1] == '=' || str[i+1] == '>')) {
+            i += 2;
+            type = token::type_id::op;
+        } else if (ch == '>' && i+1 < str.size() && str[i+1] == '=') {
+            i += 2;
+            type = token::type_id::op;
+        } else if (ch == '+' || ch == '-' || ch == '*' || ch == '/' || ch == '&' || ch == '=' || ch == '<' || ch == '>') {
+            ++i;
+            type = token::type_id::op;
+        } else {
+            throw expression::parse_exception(str, std::string("unexpected character '") + ch + "'");
+        }
+        tokens.push_back({ type, begin, i });
+    }
+    tokens.push_back({ token::type_id::end, str.size(), str.size() });
+    return tokens;
+}
+
+/**
+ * Binary precedence of an operator token, higher binds tighter.
+ */
+int get_precedence(const std::string& str, const token& tok) {
+    if (tok.type != token::type_id::op) return -1;
+    char ch = str[tok.begin];
+    if (tok.end - tok.begin == 2) return 0; // <=, >=, <>
+    if (ch == '*' || ch == '/') return 3;
+    if (ch == '+' || ch == '-') return 2;
+    if (ch == '&') return 1;
+    return 0; // =, <, >
+}
+/// Precedence of the operand of a unary `+` or `-`, which binds looser than `*` and `/`.
+const int unary_operand_precedence = 3;
+
+/**
+ * Precedence climbing parser over a token stream.
+ */
+struct parser {
+    const std::string& str;
+    std::vector<token> tokens;
+    size_t pos = 0;
+
+    parser(const std::string& str): str(str), tokens(tokenize(str)) {}
+
+    const token& peek() const { return tokens[pos]; }
+    std::string text_of(const token& tok) const { return str.substr(tok.begin, tok.end - tok.begin); }
+    void expect(token::type_id type, const char* message) {
+        if (peek().type != type) throw expression::parse_exception(str, message);
+        ++pos;
     }
 
-    // integer
-    try {
-        std::string::size_type size;
-        long long res = std::stoll(trimmed, &size);
-        if (size != trimmed.size()) throw std::invalid_argument("expect size == trimmed.size()");
-        return std::make_shared<expression::integer>(res);
-    } catch (std::exception e) {}
-
-    // reference
-    try {
-        worksheet::cell_reference ref = worksheet::cell_reference::from_code(trimmed);
-        return std::make_shared<expression::reference>(ref);
-    } catch (std::exception e) {}
-
-    // bracket
-    if (trimmed[0] == '(' && trimmed[trimmed.length()-1] == ')') {
-        try {
-            return parse(trimmed.substr(1, trimmed.length()-2));
-        } catch (std::exception e) {}
-    }
-
-    // function call
-    if (trimmed[trimmed.length()-1] == ')' && is_letter_or_underscore(trimmed[0])) {
-        // identifier
-        int i;
-        std::string func_name;
-        func_name += trimmed[0];
-        for (i = 1; is_letter_or_underscore(trimmed[i]) || (trimmed[i] >= '0' && trimmed[i] <= '9'); ++i) {
-            func_name += trimmed[i];
+    expression::parse_expr parse_expression(int min_precedence) {
+        expression::parse_expr left = parse_prefix();
+        while (true) {
+            int precedence = get_precedence(str, peek());
+            if (precedence < min_precedence) return left;
+            std::string op = text_of(tokens[pos++]);
+            expression::parse_expr right = parse_expression(precedence + 1);
+            left = std::make_shared<expression::function>(op, std::vector<expression::parse_expr>{ left, right });
         }
-        if (trimmed[i] == '(') {
-            // comma separated expressions
-            int bracket_level = 0;
-            bool is_text = false;
-            std::vector<std::string> str_args;
-            std::string cur_str_arg;
-            for (i++; i < trimmed.length()-1; ++i) { // absuing for loop(!)
-                if (trimmed[i] == '"') {
-                    is_text = !is_text;
-                }
+    }
 
-                if (is_text) {
-                    cur_str_arg += trimmed[i];
-                    continue;
+    expression::parse_expr parse_prefix() {
+        const token& tok = tokens[pos++];
+        switch (tok.type) {
+            case token::type_id::op: {
+                char op = str[tok.begin];
+                if (tok.end - tok.begin != 1 || (op != '+' && op != '-')) throw expression::parse_exception(str, "missing left operand");
+                // Signed integer literals are constants, as in `std::stoll`.
+                // The digits are read with the sign, so the most negative
+                // integer, whose magnitude is out of range, is accepted too.
+                if (peek().type == token::type_id::integer && get_precedence(str, tokens[pos + 1]) < unary_operand_precedence) {
+                    return std::make_shared<expression::integer>(integer_of(tokens[pos++], op == '-'));
                 }
-
-                if (bracket_level == 0 && trimmed[i] == ',') {
-                    str_args.push_back(cur_str_arg);
-                    cur_str_arg = "";
-                } else {
-                    cur_str_arg += trimmed[i];
+                expression::parse_expr operand = parse_expression(unary_operand_precedence);
+                int64_t negated;
+                if (std::shared_ptr<expression::integer> literal = std::dynamic_pointer_cast<expression::integer>(operand)) {
+                    if (op == '+') return literal;
+                    if (!__builtin_sub_overflow((int64_t)0, literal->raw, &negated)) return std::make_shared<expression::integer>(negated);
                 }
-
-                if (trimmed[i] == '(') bracket_level++;
-                else if (trimmed[i] == ')') {
-                    bracket_level--;
-                    if (bracket_level < 0) throw parse_exception(str, "bracket unmatched");
-                }
-
+                return std::make_shared<expression::function>(std::string(1, op), std::vector<expression::parse_expr>{ operand });
             }
-            if (bracket_level == 0) {
-                if (cur_str_arg.size() != 0 && boost::trim_copy(cur_str_arg) != "") {
-                    str_args.push_back(cur_str_arg);
-                }
-                std::vector<parse_expr> arg(str_args.size());
-                bool success = true;
-                for (int i = 0; i < str_args.size(); ++i) {
-                    try {
-                        arg[i] = parse(str_args[i]);
-                    } catch (parse_exception e) {
-                        success = false;
-                        break;
-                    }
-                }
-
-                if (success) {
-                    return std::make_shared<expression::function>(func_name, arg);
-                }
+            case token::type_id::integer:
+                return std::make_shared<expression::integer>(integer_of(tok, false));
+            case token::type_id::text:
+                return std::make_shared<expression::text>(str.substr(tok.begin + 1, tok.end - tok.begin - 2));
+            case token::type_id::open_bracket: {
+                expression::parse_expr inner = parse_expression(0);
+                expect(token::type_id::close_bracket, "bracket unmatched");
+                return inner;
             }
+            case token::type_id::identifier:
+                if (peek().type == token::type_id::open_bracket) return parse_call(tok);
+                return parse_identifier(tok);
+            case token::type_id::close_bracket:
+                throw expression::parse_exception(str, "bracket unmatched");
+            default:
+                throw expression::parse_exception(str, "missing operand");
         }
     }
 
-    // Operator
-    int bracket_level = 0;
-    bool is_text = false;
-    // Index of the operator which has smallest precedence, i is begin, j is end
-    int min_i = -1;
-    int min_j = -1;
-    int min_precedence = -1;
-    for (int i = 0; i < trimmed.size(); ++i) {
-        if (trimmed[i] == '"') {
-            is_text = !is_text;
+    /**
+     * Returns the value of an integer token, negated if `negative`.
+     *
+     * @throws expression::parse_exception Thrown if the value is out of range.
+     */
+    int64_t integer_of(const token& tok, bool negative) {
+        int64_t value = 0;
+        for (size_t i = tok.begin; i < tok.end; ++i) {
+            const int digit = str[i] - '0';
+            if (__builtin_mul_overflow(value, 10, &value) || (negative ? __builtin_sub_overflow(value, digit, &value) : __builtin_add_overflow(value, digit, &value)))
+                throw expression::parse_exception(str, "integer out of range");
         }
+        return value;
+    }
 
-        if (is_text) continue;
-
-        if (bracket_level == 0) {
-            // try current and next character (e.g. operators <=)
-            if (i < trimmed.size()-1) {
-                int precedence2 = get_precedence(trimmed.substr(i, 2));
-                if (precedence2 != -1 && (min_precedence == -1 || precedence2 <= min_precedence)) {
-                    min_i = i;
-                    min_j = i+2;
-                    min_precedence = precedence2;
-                    i++; // skip the next character
-                    continue; // no need to check bracket right?
-                }
-            }
-            int precedence1 = get_precedence(trimmed.substr(i, 1));
-            if (precedence1 != -1 && (min_precedence == -1 || precedence1 <= min_precedence)) {
-                min_i = i;
-                min_j = i+1;
-                min_precedence = precedence1;
+    expression::parse_expr parse_call(const token& name) {
+        ++pos; // (
+        std::vector<expression::parse_expr> args;
+        if (peek().type != token::type_id::close_bracket) {
+            args.push_back(parse_expression(0));
+            while (peek().type == token::type_id::comma) {
+                ++pos;
+                if (peek().type == token::type_id::close_bracket) break; // trailing comma
+                args.push_back(parse_expression(0));
             }
         }
+        expect(token::type_id::close_bracket, "bracket unmatched");
+        return std::make_shared<expression::function>(text_of(name), args);
+    }
 
-        if (trimmed[i] == '(') bracket_level++;
-        else if (trimmed[i] == ')') {
-            bracket_level--;
-            if (bracket_level < 0) throw parse_exception(str, "bracket unmatched");
-        }
+    expression::parse_expr parse_identifier(const token& tok) {
+        std::string name = text_of(tok);
+        std::string upper = name;
+        for (char& c : upper) c = toupper(c);
+        // Literal nodes are immutable, so every formula shares the same two.
+        static const expression::parse_expr true_literal = std::make_shared<expression::boolean>(true);
+        static const expression::parse_expr false_literal = std::make_shared<expression::boolean>(false);
+        if (upper == "TRUE") return true_literal;
+        if (upper == "FALSE") return false_literal;
+
+        worksheet::cell_reference ref = reference_of(tok);
+        if (peek().type != token::type_id::colon) return std::make_shared<expression::reference>(ref);
+        ++pos;
+        const token& last = tokens[pos++];
+        if (last.type != token::type_id::identifier) throw expression::parse_exception(str, "missing end of range");
+        return std::make_shared<expression::range>(worksheet::range_reference(ref, reference_of(last)));
     }
 
-    if (min_precedence != -1) {
+    worksheet::cell_reference reference_of(const token& tok) {
+        // reference: letters followed by digits
+        std::string name = text_of(tok);
+        size_t split = 0;
+        while (split < name.size() && is_letter_or_underscore(name[split]) && name[split] != '_') ++split;
+        bool is_reference = split > 0 && split < name.size();
+        for (size_t i = split; i < name.size(); ++i) is_reference = is_reference && is_digit(name[i]);
+        if (!is_reference) throw expression::parse_exception(str, "unknown identifier '" + name + "'");
+        // Columns past XFD have four letters or more, which may overflow `from_code`.
+        const size_t max_col_letters = 3;
+        if (split > max_col_letters) throw expression::parse_exception(str, "reference out of the worksheet '" + name + "'");
+        worksheet::cell_reference ref(0, 0);
         try {
-            std::vector<parse_expr> args;
-            if (!(is_unary(trimmed.substr(min_i, min_j - min_i)) && boost::trim_copy(trimmed.substr(0, min_i)) == "")) {
-                args.push_back(parse(trimmed.substr(0, min_i)));
-            }
-            args.push_back(parse(trimmed.substr(min_j)));
-            return std::make_shared<expression::function>(trimmed.substr(min_i, min_j - min_i), args);
-        } catch (parse_exception e) {
-            throw e;
+            ref = worksheet::cell_reference::from_code(name);
+        } catch (const std::logic_error& e) {
+            throw expression::parse_exception(str, "invalid reference '" + name + "'");
         }
+        if (!worksheet::contains(ref)) throw expression::parse_exception(str, "reference out of the worksheet '" + name + "'");
+        return ref;
     }
+};
+
+expression::parse_expr expression::parse(const std::string& str) {
+    // expression := --- prefix ---------------------------------------------|
+    //                             |                                      |
+    //                             -<- expression (higher) --- operator <--
+    // prefix := ------ integer --------------------|
+    //            |---- text -----------------------|
+    //            |---- TRUE, FALSE ----------------|
+    //            |---- reference ------------------|
+    //            |---- reference --- : --- reference --|
+    //            |---- function call --------------|
+    //            |---- ( --- expression --- ) -----|
+    //            ---- +, - --- expression (* /) ----
+    // function call := ----- identifier --- ( ------------------------------------- ) -----|
+    //                                          |                                 |
+    //                                          -- expression ------<-------------
+    //                                                         |                  |
+    //                                                         -- , -- expression |
+    // identifier := --- A-Z ---------------------|
+    //                |- a-z -|   |-- A-Z --|
+    //                --- _ ---   |-- a-z --|
+    //                            |--- _ ---|
+    //                            |-- 0-9 --|
+    // reference := ------ A-Z, a-z ------------ 1-9 ------------------|
+    //                 |              |                 |            |
+    //                 ------<---------                 -- 0-9 ---<---
+    // Operators from the lowest precedence: (= <> < > <= >=), &, (+ -), (* /).
+    // Binary operators are left associative.
 
-    throw parse_exception(str, "does not match any expression types");
+    parser p(str);
+    if (p.peek().type == token::type_id::end) throw parse_exception(str, "empty expresion");
+    parse_expr res = p.parse_expression(0);
+    if (p.peek().type != token::type_id::end) throw parse_exception(str, "unexpected token '" + p.text_of(p.peek()) + "'");
+    return res;
 }
 
-expression::eval_expr expression::primitive::evaluate() const { return shared_from_this(); }
+std::string expression::primitive::debug_message() const noexcept {
+    return to_value().debug_message();
+}
+expression::eval_expr expression::primitive::evaluate(context& /*ctx*/) const { return to_value(); }
+expression::eval_expr expression::integer::to_value() const { return value::of_integer(raw); }
+expression::eval_expr expression::text::to_value() const { return value::of_text(raw); }
+expression::eval_expr expression::boolean::to_value() const { return value::of_boolean(raw); }
+expression::eval_expr expression::error::to_value() const { return value::of_error(raw); }
 
-template<typename T>
-inline bool cast_and_compare(expression::eval_expr& left, expression::eval_expr& right) {
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wc++20-extensions"
-    return dynamic_pointer_cast<const T>(left)->raw == dynamic_pointer_cast<const T>(right)->raw;
-#pragma GCC diagnostic pop
-}
-
-bool operator == (expression::eval_expr& left, expression::eval_expr& right) {
-    if (left->get_type() != right->get_type()) return false;
-    switch (left->get_type()) {
-        case 1: return cast_and_compare<expression::integer>(left, right);
-        case 2: return cast_and_compare<expression::text>(left, right);
-        case 3: return cast_and_compare<expression::boolean>(left, right);
-        case 4: return cast_and_compare<expression::error>(left, right);
+expression::value expression::value::of_integer(int64_t raw) noexcept {
+    value res;
+    res.type = integer::type;
+    res.integer_raw = raw;
+    return res;
+}
+expression::value expression::value::of_text(std::string raw) noexcept {
+    value res;
+    res.type = text::type;
+    res.text_raw = std::move(raw);
+    return res;
+}
+expression::value expression::value::of_boolean(bool raw) noexcept {
+    value res;
+    res.type = boolean::type;
+    res.boolean_raw = raw;
+    return res;
+}
+expression::value expression::value::of_error(error::values raw) noexcept {
+    value res;
+    res.type = error::type;
+    res.error_raw = raw;
+    return res;
+}
+expression::value expression::value::of_range(const worksheet_reference::range_reference& raw) noexcept {
+    value res;
+    res.type = range::type;
+    res.range_raw = { raw.first.row.number, raw.first.col.number, raw.last.row.number, raw.last.col.number };
+    return res;
+}
+
+bool expression::value::operator==(const value& other) const noexcept {
+    if (type != other.type) return false;
+    switch (type) {
+        case integer::type: return integer_raw == other.integer_raw;
+        case text::type: return text_raw == other.text_raw;
+        case boolean::type: return boolean_raw == other.boolean_raw;
+        case error::type: return error_raw == other.error_raw;
+        case range::type:
+            return range_raw.first_row == other.range_raw.first_row && range_raw.first_col == other.range_raw.first_col &&
+                range_raw.last_row == other.range_raw.last_row && range_raw.last_col == other.range_raw.last_col;
         default: return false;
     }
 }
-bool operator != (expression::eval_expr& left, expression::eval_expr& right) {
-    return !(left == right);
+bool expression::value::operator!=(const value& other) const noexcept {
+    return !(*this == other);
 }
 
-std::string expression::integer::debug_message() const noexcept {
-    return "integer(" + std::to_string(raw) + ")";
+std::string expression::value::debug_message() const noexcept {
+    switch (type) {
+        case integer::type: return "integer(" + std::to_string(integer_raw) + ")";
+        case text::type: return "text(" + text_raw + ")";
+        case boolean::type: return std::string("boolean(") + (boolean_raw ? "TRUE" : "FALSE") + ")";
+        case range::type:
+            return "range(" + std::to_string(range_raw.first_row) + ", " + std::to_string(range_raw.first_col) + ", " +
+                std::to_string(range_raw.last_row) + ", " + std::to_string(range_raw.last_col) + ")";
+        default: return "error(" + error::to_string(error_raw) + ")";
+    }
 }
-std::string expression::integer::cell_value(int width) const noexcept {
+
+std::string integer_cell_value(int64_t raw, int width) noexcept {
     std::string full = std::to_string(raw);
-    if (full.length() <= width) {
+    if ((int)full.length() <= width) {
         full.insert(0, width-full.size(), ' ');
         return full;
     }
@@ -248,16 +360,16 @@ std::string expression::integer::cell_value(int width) const noexcept {
     // More space:    1.234E+10
     int exp = full.size() - 1;
     std::string exp_str = std::to_string(exp);
-    if (unsigned_width < 3+exp_str.length()) {
+    if (unsigned_width < 3+(int)exp_str.length()) {
         // 3 refers to most significant digit, 'E' and '+'.
         return std::string(width, '#');
-    } else if (unsigned_width < 5+exp_str.length()) {
+    } else if (unsigned_width < 5+(int)exp_str.length()) {
         // 5 refers to most significant digit, '.', second most significant digit, 'E' and '+'.
         std::string res = sign +
             std::string(1, full[0]) +
             "E+" +
             exp_str;
-        if (res.size() < width) res.insert(0, width-res.size(), ' ');
+        if ((int)res.size() < width) res.insert(0, width-res.size(), ' ');
         return res;
     } else {
         std::string res = sign +
@@ -266,26 +378,42 @@ std::string expression::integer::cell_value(int width) const noexcept {
             full.substr(1, unsigned_width-4-exp_str.length()) +
             "E+" +
             exp_str;
-        if (res.size() < width) res.insert(0, width-res.size(), ' ');
+        if ((int)res.size() < width) res.insert(0, width-res.size(), ' ');
         return res;
     }
 }
 
-std::string expression::text::debug_message() const noexcept {
-    return "text(" + raw + ")";
-}
-std::string expression::text::cell_value(int width) const noexcept {
+std::string text_cell_value(const std::string& raw, int width) noexcept {
     std::string res = raw.substr(0, std::min(width, (int)raw.length()));
-    if (res.size() < width) {
+    if ((int)res.size() < width) {
         res.insert(res.length(), width-res.length(), ' ');
     }
     return res;
 }
+std::string centered_cell_value(const std::string& content, int width) noexcept {
+    if ((int)content.length() > width) return std::string(width, '#');
+    return std::string((width-content.length())/2, ' ') + content + std::string(width - (width - content.length())/2 - content.length(), ' ');
+}
+std::string expression::value::cell_value(int width) const noexcept {
+    switch (type) {
+        case integer::type: return integer_cell_value(integer_raw, width);
+        case text::type: return text_cell_value(text_raw, width);
+        case boolean::type: return centered_cell_value(boolean_raw ? "TRUE" : "FALSE", width);
+        default: return centered_cell_value(error::to_string(error_raw), width);
+    }
+}
 
-std::string expression::boolean::debug_message() const noexcept {
-    return std::string("boolean(") + (raw ? "TRUE" : "FALSE") + ")";
+std::string expression::value::to_string() const noexcept {
+    switch (type) {
+        case integer::type: return std::to_string(integer_raw);
+        case text::type: return text_raw;
+        case boolean::type: return boolean_raw ? "TRUE" : "FALSE";
+        case range::type: return error::to_string(error::values::value);
+        default: return error::to_string(error_raw);
+    }
 }
-std::string expression::error::to_string() const {
+
+std::string expression::error::to_string(values raw) {
     switch (raw) {
         case values::arg: return "#ARG!";
         case values::value: return "#VALUE!";
@@ -293,48 +421,49 @@ std::string expression::error::to_string() const {
         case values::name: return "#NAME!";
         case values::recur: return "#RECUR!";
     }
+    return "";
 }
-std::string expression::error::debug_message() const noexcept {
-    return "error(" + to_string() + ")";
-}
-std::string expression::error::cell_value(int width) const noexcept {
-    std::string content = to_string();
-    if (content.length() > width) return std::string(width, '#');
-    return std::string((width-content.length())/2, ' ') + content + std::string(width - (width - content.length())/2 - content.length(), ' ');
-}
-std::string expression::boolean::cell_value(int width) const noexcept {
-    std::string content = raw ? "TRUE" : "FALSE";
-    if (content.length() > width) return std::string(width, '#');
-    return std::string((width-content.length())/2, ' ') + content + std::string(width - (width - content.length())/2 - content.length(), ' ');
+std::string expression::error::to_string() const {
+    return to_string(raw);
 }
 
-expression::eval_expr expression::reference::evaluate() const {
-    worksheet::cell& cell = workspace::ws.cells[ref];
-    return cell.calculate();
+expression::eval_expr expression::reference::evaluate(context& ctx) const {
+    return ctx.sheet.value_at(ref);
 }
 std::string expression::reference::debug_message() const noexcept {
     return "reference(" + std::to_string(ref.row.number) + ", " + std::to_string(ref.col.number) + ")";
 }
+void expression::reference::collect_references(std::vector<worksheet_reference::cell_reference>& refs, std::vector<worksheet_reference::range_reference>& /*ranges*/) const noexcept {
+    refs.push_back(ref);
+}
 
-expression::function::raw expression::function::lookup(std::string name) {
-    for (char& c : name) c = std::toupper(c);
-    if (name == "+") return op_add;
-    else if (name == "-") return op_minus;
-    else if (name == "*") return op_multiply;
-    else if (name == "/") return op_divide;
-    else if (name == "&") return op_concat;
-    else if (name == "=") return op_eq;
-    else if (name == "<>") return op_neq;
-    else if (name == "<") return op_less;
-    else if (name == "<=") return op_leq;
-    else if (name == ">") return op_greater;
-    else if (name == ">=") return op_geq;
-    else if (name == "SUM") return sum;
-    else if (name == "IF") return if_func;
-    else throw std::make_shared<error>(error::values::name);
-}
-expression::eval_expr expression::function::evaluate() const {
-    return lookup(name)(arg);
+expression::eval_expr expression::range::evaluate(context& /*ctx*/) const {
+    return value::of_range(ref);
+}
+std::string expression::range::debug_message() const noexcept {
+    return "range(" + ref.to_code() + ")";
+}
+void expression::range::collect_references(std::vector<worksheet_reference::cell_reference>& /*refs*/, std::vector<worksheet_reference::range_reference>& ranges) const noexcept {
+    ranges.push_back(ref);
+}
+
+expression::function::function(std::string name, std::vector<std::shared_ptr<expression>> arg): name(name), arg(arg), def(builtin::find(name)) {
+    if (def == nullptr) bind_error = error::values::name;
+    else if (arg.size() < def->min_arity || arg.size() > def->max_arity) bind_error = error::values::arg;
+}
+expression::eval_expr expression::function::evaluate(context& ctx) const {
+    if (bind_error) return value::of_error(*bind_error);
+    if (def->impl == nullptr) return if_func(ctx, arg);
+    // The arguments are pushed on the scratch stack, which the evaluation of
+    // the later ones may reallocate, so its data is only taken at the call.
+    const size_t base = ctx.scratch.size();
+    for (const std::shared_ptr<expression>& exp : arg) {
+        eval_expr evaluated = exp->evaluate(ctx);
+        ctx.scratch.push_back(std::move(evaluated));
+    }
+    eval_expr res = def->impl(ctx, ctx.scratch.data() + base, arg.size());
+    ctx.scratch.resize(base);
+    return res;
 }
 std::string expression::function::debug_message() const noexcept {
     std::ostringstream stream;
@@ -346,79 +475,81 @@ std::string expression::function::debug_message() const noexcept {
 
     return stream.str();
 }
-
-template<typename T>
-inline std::shared_ptr<const T> cast_or_throw(const expression::eval_expr& x) {
-    if (!x->is_type<T>()) throw std::make_shared<expression::error>(expression::error::values::value);
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wc++20-extensions"
-    return dynamic_pointer_cast<const T>(x);
-#pragma GCC diagnostic pop
+void expression::function::collect_references(std::vector<worksheet_reference::cell_reference>& refs, std::vector<worksheet_reference::range_reference>& ranges) const noexcept {
+    for (const std::shared_ptr<expression>& exp : arg) {
+        exp->collect_references(refs, ranges);
+    }
 }
 
-inline void arg_size_check(const std::vector<std::shared_ptr<expression>>& arg, size_t size) {
-    if (arg.size() != size) throw std::make_shared<expression::error>(expression::error::values::arg);
+/**
+ * Returns the first argument which is an error, or `nullptr` if there is none.
+ *
+ * Errors in the arguments take precedence over type mismatches, and the first
+ * one is propagated as the result.
+ */
+inline const expression::value* first_error(const expression::eval_expr* arg, size_t size) {
+    for (size_t i=0; i<size; ++i) {
+        if (arg[i].is_type<expression::error>()) return &arg[i];
+    }
+    return nullptr;
 }
-inline std::vector<expression::eval_expr> arg_evaluate(const std::vector<std::shared_ptr<expression>>& arg) {
-    std::vector<expression::eval_expr> evaluated(arg.size());
-    for (int i=0; i<arg.size(); ++i) {
-        evaluated[i] = arg[i]->evaluate();
+template<typename T>
+inline bool all_of_type(const expression::eval_expr* arg, size_t size) {
+    for (size_t i=0; i<size; ++i) {
+        if (!arg[i].is_type<T>()) return false;
     }
-    return evaluated;
+    return true;
 }
 
-#define EXPRESSION_FUNCTION_IMPLEMENTATION(name) expression::eval_expr expression::function::name(const std::vector<std::shared_ptr<expression>>& arg)
+// The number of arguments is checked against the registry when the function is bound.
+#define EXPRESSION_FUNCTION_IMPLEMENTATION(name) expression::eval_expr expression::function::name(context& /*ctx*/, const eval_expr* arg, size_t size)
+// Functions reading ranges from the worksheet of the context.
+#define EXPRESSION_AGGREGATE_IMPLEMENTATION(name) expression::eval_expr expression::function::name(context& ctx, const eval_expr* arg, size_t size)
+#define check_arguments(T) \
+    if (const value* err = first_error(arg, size)) return *err; \
+    if (!all_of_type<T>(arg, size)) return value::of_error(error::values::value)
 
 EXPRESSION_FUNCTION_IMPLEMENTATION(op_add) {
-    auto evaluated = arg_evaluate(arg);
-    if (arg.size() == 1) {
-        return std::make_shared<integer>(cast_or_throw<integer>(evaluated[0])->raw);
-    } else if (arg.size() == 2) {
-        return std::make_shared<integer>(cast_or_throw<integer>(evaluated[0])->raw + cast_or_throw<integer>(evaluated[1])->raw);
-    } else {
-        throw std::make_shared<expression::error>(expression::error::values::arg);
+    check_arguments(integer);
+    if (size == 1) {
+        return value::of_integer(arg[0].integer_raw);
     }
+    return value::of_integer(arg[0].integer_raw + arg[1].integer_raw);
 }
 EXPRESSION_FUNCTION_IMPLEMENTATION(op_minus) {
-    auto evaluated = arg_evaluate(arg);
-    if (arg.size() == 1) {
-        return std::make_shared<integer>(-cast_or_throw<integer>(evaluated[0])->raw);
-    } else if (arg.size() == 2) {
-        return std::make_shared<integer>(cast_or_throw<integer>(evaluated[0])->raw - cast_or_throw<integer>(evaluated[1])->raw);
-    } else {
-        throw std::make_shared<expression::error>(expression::error::values::arg);
+    check_arguments(integer);
+    if (size == 1) {
+        return value::of_integer(-arg[0].integer_raw);
     }
+    return value::of_integer(arg[0].integer_raw - arg[1].integer_raw);
 }
 EXPRESSION_FUNCTION_IMPLEMENTATION(op_multiply) {
-    arg_size_check(arg, 2);
-    auto evaluated = arg_evaluate(arg);
-    return std::make_shared<integer>(cast_or_throw<integer>(evaluated[0])->raw * cast_or_throw<integer>(evaluated[1])->raw);
+    check_arguments(integer);
+    return value::of_integer(arg[0].integer_raw * arg[1].integer_raw);
 }
 EXPRESSION_FUNCTION_IMPLEMENTATION(op_divide) {
-    arg_size_check(arg, 2);
-    auto evaluated = arg_evaluate(arg);
-    int64_t dividend = cast_or_throw<integer>(evaluated[0])->raw;
-    int64_t divisor = cast_or_throw<integer>(evaluated[1])->raw;
+    check_arguments(integer);
+    int64_t dividend = arg[0].integer_raw;
+    int64_t divisor = arg[1].integer_raw;
     if (divisor == 0) {
-        throw std::make_shared<expression::error>(expression::error::values::div0);
+        return value::of_error(error::values::div0);
     }
-    return std::make_shared<integer>(dividend / divisor);
+    return value::of_integer(dividend / divisor);
 }
 EXPRESSION_FUNCTION_IMPLEMENTATION(op_concat) {
-    arg_size_check(arg, 2);
-    auto evaluated = arg_evaluate(arg);
-    return std::make_shared<text>(cast_or_throw<text>(evaluated[0])->raw + cast_or_throw<text>(evaluated[1])->raw);
+    check_arguments(text);
+    return value::of_text(arg[0].text_raw + arg[1].text_raw);
 }
-#define equality_operator_case(op,typeid,typename) \
-    case typeid: \
-        return std::make_shared<boolean>(evaluated[1]->get_type() == typeid && cast_or_throw<typename>(evaluated[0])->raw op cast_or_throw<typename>(evaluated[1])->raw);
+#define equality_operator_case(op,typename) \
+    case typename::type: \
+        return value::of_boolean(arg[1].type == typename::type && arg[0].get<typename>() op arg[1].get<typename>());
 #define equality_operator(op) \
-    auto evaluated = arg_evaluate(arg); \
-    switch (evaluated[0]->get_type()) { \
-        equality_operator_case(op,1,integer) \
-        equality_operator_case(op,2,text) \
-        equality_operator_case(op,3,boolean) \
-        default: throw std::make_shared<expression::error>(expression::error::values::value);\
+    if (const value* err = first_error(arg, size)) return *err; \
+    switch (arg[0].type) { \
+        equality_operator_case(op,integer) \
+        equality_operator_case(op,text) \
+        equality_operator_case(op,boolean) \
+        default: return value::of_error(error::values::value);\
     }
 EXPRESSION_FUNCTION_IMPLEMENTATION(op_eq) {
     equality_operator(==)
@@ -438,18 +569,173 @@ EXPRESSION_FUNCTION_IMPLEMENTATION(op_greater) {
 EXPRESSION_FUNCTION_IMPLEMENTATION(op_geq) {
     equality_operator(>=)
 }
-EXPRESSION_FUNCTION_IMPLEMENTATION(sum) {
-    int64_t ans = 0;
-    for (const std::shared_ptr<expression>& x : arg) {
-        ans += cast_or_throw<integer>(x->evaluate())->raw;
+/**
+ * Add the integers of aggregate function arguments to `t`.
+ *
+ * A direct argument must be an integer. Cells of a range argument which are
+ * not integers are skipped, except errors. Each column of a range is checked
+ * for errors and then added by the kernels in `simd`, a run of allocated
+ * tile at a time.
+ *
+ * Unlike the operators, the arguments are checked in order, so the first
+ * argument which is an error or not an integer decides the error, as when
+ * they were evaluated one at a time.
+ *
+ * @returns The first error met, in column-major order within a range, or
+ *     `#VALUE!` for a direct argument which is not an integer.
+ */
+inline std::optional<expression::value> aggregate(const worksheet& sheet, const expression::eval_expr* arg, size_t size, simd::totals& t) {
+    for (size_t i=0; i<size; ++i) {
+        if (arg[i].is_type<expression::error>()) {
+            return arg[i];
+        } else if (arg[i].is_type<expression::integer>()) {
+            t.add(arg[i].integer_raw);
+        } else if (arg[i].is_type<expression::range>()) {
+            const expression::value::range_bounds& bounds = arg[i].range_raw;
+            std::optional<expression::value> err;
+            for (int c = bounds.first_col; c <= bounds.last_col && !err; ++c) {
+                sheet.for_each_column_run(c, bounds.first_row, bounds.last_row, [&](worksheet::tile& run, int index, int n) {
+                    if (err) return;
+                    const size_t found = simd::find_type(run.types.data() + index, n, expression::error::type);
+                    if (found < (size_t)n) err = expression::value::of_error((expression::error::values)run.data[index + found]);
+                    else simd::add_integers(run.data.data() + index, run.types.data() + index, n, expression::integer::type, t);
+                });
+            }
+            if (err) return err;
+        } else {
+            return expression::value::of_error(expression::error::values::value);
+        }
     }
-    return std::make_shared<integer>(ans);
+    return std::nullopt;
+}
+
+EXPRESSION_AGGREGATE_IMPLEMENTATION(sum) {
+    simd::totals t;
+    if (auto err = aggregate(ctx.sheet, arg, size, t)) return *err;
+    return value::of_integer(t.sum);
+}
+EXPRESSION_AGGREGATE_IMPLEMENTATION(min) {
+    simd::totals t;
+    if (auto err = aggregate(ctx.sheet, arg, size, t)) return *err;
+    return value::of_integer(t.count ? t.min : 0);
 }
-EXPRESSION_FUNCTION_IMPLEMENTATION(if_func) {
-    arg_size_check(arg, 3);
-    if (cast_or_throw<boolean>(arg[0]->evaluate())->raw) {
-        return arg[1]->evaluate();
+EXPRESSION_AGGREGATE_IMPLEMENTATION(max) {
+    simd::totals t;
+    if (auto err = aggregate(ctx.sheet, arg, size, t)) return *err;
+    return value::of_integer(t.count ? t.max : 0);
+}
+EXPRESSION_AGGREGATE_IMPLEMENTATION(count) {
+    // Unlike the other aggregates, COUNT ignores anything which is not an integer.
+    int64_t ans = 0;
+    for (size_t i=0; i<size; ++i) {
+        if (arg[i].is_type<integer>()) {
+            ans++;
+        } else if (arg[i].is_type<range>()) {
+            const value::range_bounds& bounds = arg[i].range_raw;
+            for (int c = bounds.first_col; c <= bounds.last_col; ++c) {
+                ctx.sheet.for_each_column_run(c, bounds.first_row, bounds.last_row, [&](worksheet::tile& run, int index, int n) {
+                    ans += simd::count_type(run.types.data() + index, n, integer::type);
+                });
+            }
+        }
+    }
+    return value::of_integer(ans);
+}
+EXPRESSION_AGGREGATE_IMPLEMENTATION(average) {
+    simd::totals t;
+    if (auto err = aggregate(ctx.sheet, arg, size, t)) return *err;
+    if (t.count == 0) return value::of_error(error::values::div0);
+    return value::of_integer(t.sum / t.count);
+}
+expression::eval_expr expression::function::if_func(context& ctx, const std::vector<std::shared_ptr<expression>>& arg) {
+    eval_expr condition = arg[0]->evaluate(ctx);
+    if (!condition.is_type<boolean>()) return if_condition_error(condition);
+    if (condition.boolean_raw) {
+        return arg[1]->evaluate(ctx);
     } else {
-        return arg[2]->evaluate();
+        return arg[2]->evaluate(ctx);
+    }
+}
+
+expression::eval_expr expression::function::if_condition_error(const eval_expr& condition) {
+    if (condition.is_type<error>()) return condition;
+    return value::of_error(error::values::value);
+}
+
+constexpr expression::function::builtin builtins[] = {
+    { "+", 1, 2, expression::function::op_add },
+    { "-", 1, 2, expression::function::op_minus },
+    { "*", 2, 2, expression::function::op_multiply },
+    { "/", 2, 2, expression::function::op_divide },
+    { "&", 2, 2, expression::function::op_concat },
+    { "=", 2, 2, expression::function::op_eq },
+    { "<>", 2, 2, expression::function::op_neq },
+    { "<", 2, 2, expression::function::op_less },
+    { "<=", 2, 2, expression::function::op_leq },
+    { ">", 2, 2, expression::function::op_greater },
+    { ">=", 2, 2, expression::function::op_geq },
+    { "SUM", 0, UINT16_MAX, expression::function::sum },
+    { "MIN", 1, UINT16_MAX, expression::function::min },
+    { "MAX", 1, UINT16_MAX, expression::function::max },
+    { "COUNT", 1, UINT16_MAX, expression::function::count },
+    { "AVERAGE", 1, UINT16_MAX, expression::function::average },
+    { "IF", 3, 3, nullptr },
+};
+constexpr size_t builtin_count = sizeof(builtins) / sizeof(builtins[0]);
+constexpr size_t builtin_slot_count = 64;
+static_assert(builtin_count <= builtin_slot_count, "registry is full");
+
+/**
+ * Case-insensitive FNV-1a hash of a function name.
+ */
+constexpr uint32_t builtin_hash(const char* name, size_t length, uint32_t seed) {
+    uint32_t hash = 2166136261u ^ seed;
+    for (size_t i=0; i<length; ++i) {
+        char c = name[i];
+        if (c >= 'a' && c <= 'z') c += 'A' - 'a';
+        hash = (hash ^ (uint8_t)c) * 16777619u;
+    }
+    return hash;
+}
+constexpr size_t builtin_name_length(const char* name) {
+    size_t length = 0;
+    while (name[length]) ++length;
+    return length;
+}
+/**
+ * Find the first seed which hashes every built-in name to a different slot.
+ */
+constexpr uint32_t builtin_perfect_seed() {
+    for (uint32_t seed = 0; ; ++seed) {
+        bool used[builtin_slot_count] = {};
+        bool collision = false;
+        for (size_t i=0; i<builtin_count && !collision; ++i) {
+            size_t slot = builtin_hash(builtins[i].name, builtin_name_length(builtins[i].name), seed) % builtin_slot_count;
+            collision = used[slot];
+            used[slot] = true;
+        }
+        if (!collision) return seed;
+    }
+}
+constexpr uint32_t builtin_seed = builtin_perfect_seed();
+struct builtin_table { int8_t slots[builtin_slot_count]; };
+constexpr builtin_table make_builtin_table() {
+    builtin_table table = {};
+    for (size_t i=0; i<builtin_slot_count; ++i) table.slots[i] = -1;
+    for (size_t i=0; i<builtin_count; ++i) {
+        table.slots[builtin_hash(builtins[i].name, builtin_name_length(builtins[i].name), builtin_seed) % builtin_slot_count] = i;
+    }
+    return table;
+}
+constexpr builtin_table builtin_slots = make_builtin_table();
+
+const expression::function::builtin* expression::function::builtin::find(const std::string& name) noexcept {
+    int8_t index = builtin_slots.slots[builtin_hash(name.data(), name.size(), builtin_seed) % builtin_slot_count];
+    if (index == -1) return nullptr;
+    const builtin& candidate = builtins[index];
+    if (builtin_name_length(candidate.name) != name.size()) return nullptr;
+    for (size_t i=0; i<name.size(); ++i) {
+        if (std::toupper((unsigned char)name[i]) != candidate.name[i]) return nullptr;
     }
+    return &candidate;
 }
@@ -2,11 +2,17 @@
 #define __INCLUDE_EXPRESSION_
 
 #include "worksheet_reference.h"
+#include <cstddef>
 #include <string>
 #include <map>
+#include <memory>
+#include <functional>
+#include <optional>
 #include <vector>
 #include <sstream>
 
+class worksheet;
+
 /**
  * Define the evaluation of expressions in formulas.
  */
@@ -16,15 +22,20 @@ struct expression {
     struct text;
     struct boolean;
     struct error;
+    struct value;
     struct compound;
     struct function;
     struct reference;
+    struct range;
     struct parse_exception;
+    struct bytecode;
+    struct context;
+    struct image;
 
     /**
      * Evaluated expression type.
      */
-    typedef std::shared_ptr<const primitive> eval_expr;
+    typedef value eval_expr;
 
     /**
      * Parsed expression type.
@@ -32,9 +43,11 @@ struct expression {
     typedef std::shared_ptr<expression> parse_expr;
 
     /**
-     * Evaluate the expression.
+     * Evaluate the expression, reading referenced cells from `ctx.sheet`.
+     *
+     * Errors are returned as `expression::error` values, never thrown.
      */
-    virtual eval_expr evaluate() const = 0;
+    virtual eval_expr evaluate(context& ctx) const = 0;
 
     /**
      * Parse an expresion text.
@@ -48,6 +61,27 @@ struct expression {
      */
     virtual std::string debug_message() const noexcept = 0;
 
+    /**
+     * Append the cells referenced anywhere in the expression tree to `refs`.
+     *
+     * Used by `worksheet` to build the dependency graph between cells.
+     */
+    virtual void collect_references(std::vector<worksheet_reference::cell_reference>& /*refs*/, std::vector<worksheet_reference::range_reference>& /*ranges*/) const noexcept {}
+
+    /**
+     * Append the instructions evaluating this expression to `code`.
+     *
+     * @see expression::bytecode
+     */
+    virtual void compile(bytecode& code) const = 0;
+
+    /**
+     * Append the nodes of the expression tree to `img`.
+     *
+     * @see expression::image
+     */
+    virtual void store(image& img) const = 0;
+
     template<class exp>
     friend std::ostream& operator<<(std::ostream& os, const std::shared_ptr<exp> self);
 };
@@ -74,7 +108,7 @@ static_assert(true, "require semi-colon after macro, https://stackoverflow.com/a
 /**
  * A primitive expression represents data with basic types and is reduced to its simplest form.
  */
-struct expression::primitive: expression, std::enable_shared_from_this<expression::primitive> {
+struct expression::primitive: expression {
     /**
      * Type ID of a primitive type.
      */
@@ -92,28 +126,25 @@ struct expression::primitive: expression, std::enable_shared_from_this<expressio
         return this->get_type() == T::type;
     }
 
+    /**
+     * Get the value the primitive expression holds.
+     */
+    virtual eval_expr to_value() const = 0;
     /**
      * Evaluate the expression.
      *
-     * Since a primitive expression is already evaluated, this just returns a
-     * pointer to itself.
+     * Since a primitive expression is already evaluated, this just returns
+     * the value it holds.
      */
-    eval_expr evaluate() const override;
+    eval_expr evaluate(context& ctx) const override;
+
+    void compile(bytecode& code) const override;
+    void store(image& img) const override;
 
     /**
      * Generate a text representation of the expression tree for debug purpose.
      */
-    virtual std::string debug_message() const noexcept override = 0;
-    /**
-     * Generate a text representation of the evaluated expression to be
-     * displayed in a worksheet cell.
-     *
-     * @param width Width the the worksheet cell.
-     */
-    virtual std::string cell_value(int width) const noexcept = 0;
-
-    friend bool operator == (std::shared_ptr<const primitive>& left, std::shared_ptr<const primitive>& right);
-    friend bool operator != (std::shared_ptr<const primitive>& left, std::shared_ptr<const primitive>& right);
+    std::string debug_message() const noexcept override;
 };
 /**
  * An integer expression.
@@ -123,8 +154,7 @@ struct expression::integer: expression::primitive {
     primitive_get_type;
     int64_t raw;
     integer(int64_t raw): raw(raw) {};
-    std::string debug_message() const noexcept override;
-    std::string cell_value(int width) const noexcept override;
+    eval_expr to_value() const override;
 };
 /**
  * A text expression.
@@ -134,8 +164,7 @@ struct expression::text: expression::primitive {
     primitive_get_type;
     std::string raw;
     text(std::string raw): raw(raw) {};
-    std::string debug_message() const noexcept override;
-    std::string cell_value(int width) const noexcept override;
+    eval_expr to_value() const override;
 };
 /**
  * A boolean expression.
@@ -145,8 +174,7 @@ struct expression::boolean: expression::primitive {
     primitive_get_type;
     bool raw;
     boolean(bool raw): raw(raw) {};
-    std::string debug_message() const noexcept override;
-    std::string cell_value(int width) const noexcept override;
+    eval_expr to_value() const override;
 };
 /**
  * An runtime error expression.
@@ -185,8 +213,97 @@ struct expression::error: expression::primitive {
     values raw;
     error(values raw): raw(raw) {}
     std::string to_string() const;
-    std::string debug_message() const noexcept override;
-    std::string cell_value(int width) const noexcept override;
+    static std::string to_string(values raw);
+    eval_expr to_value() const override;
+};
+
+/**
+ * An evaluated value of one of the primitive types, or a range which is only
+ * accepted as an argument of aggregate functions.
+ *
+ * Values are passed by value: integers, booleans and errors are stored
+ * inline, and texts in a `std::string` which keeps short texts inline too,
+ * so evaluation does not allocate or reference count.
+ */
+struct expression::value {
+    /// Bounds of a range value, see `expression::range`.
+    struct range_bounds {
+        int first_row, first_col, last_row, last_col;
+    };
+
+    /// Type ID, the `type` of the corresponding primitive expression or `expression::range`.
+    int8_t type;
+    union {
+        int64_t integer_raw;
+        bool boolean_raw;
+        error::values error_raw;
+        range_bounds range_raw;
+    };
+    std::string text_raw;
+
+    /// An empty text.
+    value() noexcept: type(text::type), integer_raw(0) {}
+    static value of_integer(int64_t raw) noexcept;
+    static value of_text(std::string raw) noexcept;
+    static value of_boolean(bool raw) noexcept;
+    static value of_error(error::values raw) noexcept;
+    static value of_range(const worksheet_reference::range_reference& raw) noexcept;
+
+    /**
+     * Returns whether the value is of a particular primitive type.
+     */
+    template<typename T>
+    bool is_type() const noexcept {
+        return type == T::type;
+    }
+    /**
+     * Get the raw data of a particular primitive type. The value must be of that type.
+     */
+    template<typename T>
+    const auto& get() const noexcept {
+        if constexpr (T::type == integer::type) return integer_raw;
+        else if constexpr (T::type == text::type) return text_raw;
+        else if constexpr (T::type == boolean::type) return boolean_raw;
+        else return error_raw;
+    }
+
+    /**
+     * Generate a text representation of the value for debug purpose.
+     */
+    std::string debug_message() const noexcept;
+    /**
+     * Generate a text representation of the value to be displayed in a
+     * worksheet cell.
+     *
+     * @param width Width the the worksheet cell.
+     */
+    std::string cell_value(int width) const noexcept;
+    /**
+     * Generate the full text of the value, as written when exporting a
+     * worksheet.
+     */
+    std::string to_string() const noexcept;
+
+    bool operator==(const value& other) const noexcept;
+    bool operator!=(const value& other) const noexcept;
+};
+
+/**
+ * State an expression is evaluated with, passed through `evaluate` and the
+ * built-in functions so that evaluation reads no global state. Threads
+ * evaluating at the same time each use their own context.
+ */
+struct expression::context {
+    /// Worksheet the references are read from.
+    const worksheet& sheet;
+    /**
+     * Values reused as a stack between evaluations instead of allocating
+     * them each time, for the bytecode stack and function arguments.
+     * Evaluation leaves it as it found it.
+     */
+    std::vector<value> scratch;
+
+    context(const worksheet& sheet): sheet(sheet) {}
 };
 
 /**
@@ -196,36 +313,106 @@ struct expression::error: expression::primitive {
 struct expression::compound: expression {};
 struct expression::reference: expression {
     struct not_evaluated_exception;
-    std::shared_ptr<const primitive> evaluate() const override;
+    eval_expr evaluate(context& ctx) const override;
     worksheet_reference::cell_reference ref;
     reference(worksheet_reference::cell_reference ref): ref(ref) {}
     std::string debug_message() const noexcept override;
+    void collect_references(std::vector<worksheet_reference::cell_reference>& refs, std::vector<worksheet_reference::range_reference>& ranges) const noexcept override;
+    void compile(bytecode& code) const override;
+    void store(image& img) const override;
+};
+/**
+ * A reference to a range of cells.
+ *
+ * A range evaluates to a range value without reading its cells, which
+ * aggregate functions then iterate directly. Anywhere else it is `#VALUE!`.
+ */
+struct expression::range: expression {
+    /// Type ID of range values.
+    static const int8_t type = 5;
+    worksheet_reference::range_reference ref;
+    range(worksheet_reference::range_reference ref): ref(ref) {}
+    eval_expr evaluate(context& ctx) const override;
+    std::string debug_message() const noexcept override;
+    void collect_references(std::vector<worksheet_reference::cell_reference>& refs, std::vector<worksheet_reference::range_reference>& ranges) const noexcept override;
+    void compile(bytecode& code) const override;
+    void store(image& img) const override;
 };
 struct expression::function: expression {
-    typedef std::function<std::shared_ptr<const primitive>(const std::vector<std::shared_ptr<expression>>&)> raw;
-    static raw lookup(std::string name);
+    struct builtin;
+
+    /**
+     * Implementation of a function taking its evaluated arguments.
+     *
+     * `IF` is not one of them since only one of its branches is evaluated.
+     */
+    typedef eval_expr (*raw)(context& ctx, const eval_expr* arg, size_t size);
 
     std::string name;
     std::vector<std::shared_ptr<expression>> arg;
-    std::shared_ptr<const primitive> evaluate() const override;
+    /**
+     * The built-in function called, bound from `name` on construction.
+     * `nullptr` if no function has that name.
+     */
+    const builtin* def;
+    /**
+     * Error returned instead of calling the function, `#NAME!` for an unknown
+     * name or `#ARG!` for a wrong number of arguments.
+     */
+    std::optional<error::values> bind_error;
+    eval_expr evaluate(context& ctx) const override;
 
-    function(std::string name, std::vector<std::shared_ptr<expression>> arg): name(name), arg(arg) { }
+    function(std::string name, std::vector<std::shared_ptr<expression>> arg);
 
     std::string debug_message() const noexcept override;
+    void collect_references(std::vector<worksheet_reference::cell_reference>& refs, std::vector<worksheet_reference::range_reference>& ranges) const noexcept override;
+    void compile(bytecode& code) const override;
+    void store(image& img) const override;
 
-    static std::shared_ptr<const primitive> op_add(const std::vector<std::shared_ptr<expression>>& arg);
-    static std::shared_ptr<const primitive> op_minus(const std::vector<std::shared_ptr<expression>>& arg);
-    static std::shared_ptr<const primitive> op_multiply(const std::vector<std::shared_ptr<expression>>& arg);
-    static std::shared_ptr<const primitive> op_divide(const std::vector<std::shared_ptr<expression>>& arg);
-    static std::shared_ptr<const primitive> op_concat(const std::vector<std::shared_ptr<expression>>& arg);
-    static std::shared_ptr<const primitive> op_eq(const std::vector<std::shared_ptr<expression>>& arg);
-    static std::shared_ptr<const primitive> op_neq(const std::vector<std::shared_ptr<expression>>& arg);
-    static std::shared_ptr<const primitive> op_less(const std::vector<std::shared_ptr<expression>>& arg);
-    static std::shared_ptr<const primitive> op_leq(const std::vector<std::shared_ptr<expression>>& arg);
-    static std::shared_ptr<const primitive> op_greater(const std::vector<std::shared_ptr<expression>>& arg);
-    static std::shared_ptr<const primitive> op_geq(const std::vector<std::shared_ptr<expression>>& arg);
-    static std::shared_ptr<const primitive> sum(const std::vector<std::shared_ptr<expression>>& arg);
-    static std::shared_ptr<const primitive> if_func(const std::vector<std::shared_ptr<expression>>& arg);
+    /**
+     * Result of `IF` when its evaluated condition is not a boolean: the
+     * condition itself if it is an error, otherwise `#VALUE!`.
+     */
+    static eval_expr if_condition_error(const eval_expr& condition);
+
+    static eval_expr op_add(context& ctx, const eval_expr* arg, size_t size);
+    static eval_expr op_minus(context& ctx, const eval_expr* arg, size_t size);
+    static eval_expr op_multiply(context& ctx, const eval_expr* arg, size_t size);
+    static eval_expr op_divide(context& ctx, const eval_expr* arg, size_t size);
+    static eval_expr op_concat(context& ctx, const eval_expr* arg, size_t size);
+    static eval_expr op_eq(context& ctx, const eval_expr* arg, size_t size);
+    static eval_expr op_neq(context& ctx, const eval_expr* arg, size_t size);
+    static eval_expr op_less(context& ctx, const eval_expr* arg, size_t size);
+    static eval_expr op_leq(context& ctx, const eval_expr* arg, size_t size);
+    static eval_expr op_greater(context& ctx, const eval_expr* arg, size_t size);
+    static eval_expr op_geq(context& ctx, const eval_expr* arg, size_t size);
+    static eval_expr sum(context& ctx, const eval_expr* arg, size_t size);
+    static eval_expr min(context& ctx, const eval_expr* arg, size_t size);
+    static eval_expr max(context& ctx, const eval_expr* arg, size_t size);
+    static eval_expr count(context& ctx, const eval_expr* arg, size_t size);
+    static eval_expr average(context& ctx, const eval_expr* arg, size_t size);
+    static eval_expr if_func(context& ctx, const std::vector<std::shared_ptr<expression>>& arg);
+};
+
+/**
+ * Entry of the built-in function registry.
+ */
+struct expression::function::builtin {
+    /// Upper case name of the function or operator.
+    const char* name;
+    uint16_t min_arity;
+    uint16_t max_arity;
+    /// Implementation, `nullptr` for `IF` whose arguments are evaluated lazily.
+    raw impl;
+
+    /**
+     * Find a built-in function by its case-insensitive name.
+     *
+     * The registry is a perfect hash table built at compile time.
+     *
+     * @returns `nullptr` if no function has the name.
+     */
+    static const builtin* find(const std::string& name) noexcept;
 };
 
 #endif
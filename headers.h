@@ -3,6 +3,13 @@
 #include "terminal.h"
 #include "worksheet_reference.h"
 #include "expression.h"
+#include "bytecode.h"
+#include "simd.h"
 #include "worksheet.h"
 #include "workspace.h"
+#include "csv.h"
+#include "mapped_file.h"
+#include "snapshot.h"
+#include "journal.h"
+#include "event_loop.h"
 #endif
@@ -0,0 +1,210 @@
+#include "journal.h"
+#include "mapped_file.h"
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <optional>
+#include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+    const char magic[8] = { 'C', 'J', 'O', 'U', 'R', 'N', '\0', '\x1A' };
+    const uint32_t version = 1;
+    /// Bytes of the row and column starting a record.
+    const uint32_t ref_size = 2 * sizeof(int32_t);
+
+    std::array<uint32_t, 256> make_crc_table() {
+        std::array<uint32_t, 256> table;
+        for (uint32_t i=0; i<256; ++i) {
+            uint32_t crc = i;
+            for (int bit=0; bit<8; ++bit) crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+            table[i] = crc;
+        }
+        return table;
+    }
+
+    /// CRC-32 of IEEE 802.3, as used by zlib.
+    uint32_t crc32(const char* data, size_t size) noexcept {
+        static const std::array<uint32_t, 256> table = make_crc_table();
+        uint32_t crc = 0xFFFFFFFF;
+        for (size_t i=0; i<size; ++i) crc = table[(crc ^ (uint8_t)data[i]) & 0xFF] ^ (crc >> 8);
+        return ~crc;
+    }
+
+    /**
+     * Write all `size` bytes, retrying short writes.
+     *
+     * @returns Whether they were written, with `errno` set otherwise.
+     */
+    bool write_all(int fd, const char* data, size_t size) {
+        while (size > 0) {
+            ssize_t written = write(fd, data, size);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            data += written;
+            size -= written;
+        }
+        return true;
+    }
+}
+
+std::string journal::path_of(const std::string& snapshot_path) {
+    return snapshot_path + ".journal";
+}
+
+journal::journal(const std::string& path): path(path) {
+    fd = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) throw std::system_error(errno, std::generic_category(), path);
+    writer = std::thread(&journal::run_writer, this);
+}
+
+journal::~journal() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    appended_cv.notify_one();
+    writer.join();
+    close(fd);
+}
+
+void journal::run_writer() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        appended_cv.wait(lock, [&]() { return stopping || !pending.empty(); });
+        if (pending.empty()) return;
+
+        // Edits appended while this batch is written and synced wait for the
+        // next one, so a burst of edits shares a few syncs.
+        std::string batch;
+        batch.swap(pending);
+        writing = true;
+        lock.unlock();
+        int err = 0;
+        if (!write_all(fd, batch.data(), batch.size()) || fdatasync(fd) != 0) err = errno;
+        lock.lock();
+        writing = false;
+        if (err != 0 && error == 0) error = err;
+        synced_cv.notify_all();
+    }
+}
+
+void journal::start_over(uint32_t generation) {
+    header h = {};
+    std::memcpy(h.magic, magic, sizeof magic);
+    h.version = version;
+    h.generation = generation;
+    if (ftruncate(fd, 0) != 0 || !write_all(fd, (const char*)&h, sizeof h) || fdatasync(fd) != 0) {
+        throw std::system_error(errno, std::generic_category(), path);
+    }
+    file_size = sizeof h;
+    error = 0;
+}
+
+namespace {
+    /**
+     * Load the edits of a journal file into a worksheet loaded from the
+     * snapshot of `generation`, without recalculating them.
+     *
+     * @param changed Cells edited, appended to.
+     * @returns End of the last valid record, or nothing if the journal does
+     *     not follow the snapshot of `generation`.
+     */
+    std::optional<uint64_t> load_records(worksheet& sheet, const mapped_file& file, uint32_t generation, std::vector<worksheet::cell_reference>& changed) {
+        journal::header h;
+        if (file.size < sizeof h) return std::nullopt;
+        std::memcpy(&h, file.data, sizeof h);
+        if (std::memcmp(h.magic, magic, sizeof magic) != 0 || h.version != version || h.generation != generation) return std::nullopt;
+
+        uint64_t end = sizeof h;
+        while (true) {
+            journal::record_header record;
+            if (file.size - end < sizeof record) break;
+            std::memcpy(&record, file.data + end, sizeof record);
+            if (record.size < ref_size || file.size - end - sizeof record < record.size) break;
+            const char* payload = file.data + end + sizeof record;
+            if (crc32(payload, record.size) != record.checksum) break;
+            end += sizeof record + record.size;
+
+            int32_t cell[2];
+            std::memcpy(cell, payload, ref_size);
+            const worksheet::cell_reference ref(cell[0], cell[1]);
+            if (!worksheet::contains(ref)) continue;
+            try {
+                sheet.load_raw(ref, std::string(payload + ref_size, record.size - ref_size));
+                changed.push_back(ref);
+            } catch (const expression::parse_exception& e) {
+                // Only edits which parsed are journaled, so this one is from a
+                // version parsing differently. Skip it like a CSV field.
+            }
+        }
+        return end;
+    }
+}
+
+size_t journal::replay(worksheet& sheet, uint32_t generation) {
+    std::unique_lock<std::mutex> lock(mutex);
+    synced_cv.wait(lock, [&]() { return pending.empty() && !writing; });
+
+    const mapped_file file(path);
+    std::vector<worksheet::cell_reference> changed;
+    const std::optional<uint64_t> end = load_records(sheet, file, generation, changed);
+    if (!end) {
+        start_over(generation);
+        return 0;
+    }
+    // Anything after the last whole record was torn by a crash, and is cut
+    // so the next edits are not appended after it.
+    if (*end < file.size && ftruncate(fd, *end) != 0) throw std::system_error(errno, std::generic_category(), path);
+    file_size = *end;
+    lock.unlock();
+
+    if (!changed.empty()) sheet.recalculate(changed);
+    return changed.size();
+}
+
+size_t journal::apply(worksheet& sheet, const std::string& path, uint32_t generation) {
+    const mapped_file file(path);
+    std::vector<worksheet::cell_reference> changed;
+    load_records(sheet, file, generation, changed);
+    if (!changed.empty()) sheet.recalculate(changed);
+    return changed.size();
+}
+
+void journal::append(const worksheet::cell_reference& ref, const std::string& raw) {
+    record_header h;
+    h.size = ref_size + raw.size();
+    std::string record(sizeof h + h.size, '\0');
+    char* payload = record.data() + sizeof h;
+    const int32_t cell[2] = { ref.row.number, ref.col.number };
+    std::memcpy(payload, cell, ref_size);
+    std::memcpy(payload + ref_size, raw.data(), raw.size());
+    h.checksum = crc32(payload, h.size);
+    std::memcpy(record.data(), &h, sizeof h);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending += record;
+        file_size += record.size();
+    }
+    appended_cv.notify_one();
+}
+
+void journal::commit() {
+    std::unique_lock<std::mutex> lock(mutex);
+    synced_cv.wait(lock, [&]() { return pending.empty() && !writing; });
+    if (error != 0) throw std::system_error(error, std::generic_category(), path);
+}
+
+void journal::reset(uint32_t generation) {
+    std::unique_lock<std::mutex> lock(mutex);
+    synced_cv.wait(lock, [&]() { return pending.empty() && !writing; });
+    start_over(generation);
+}
+
+uint64_t journal::size() const noexcept {
+    std::lock_guard<std::mutex> lock(mutex);
+    return file_size;
+}
@@ -0,0 +1,149 @@
+#ifndef __INCLUDE_JOURNAL_
+#define __INCLUDE_JOURNAL_
+
+#include "worksheet.h"
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/**
+ * Append-only journal of the edits made to a worksheet since its snapshot
+ * was written, kept next to the snapshot with `.journal` appended to its
+ * name.
+ *
+ * The journal starts with a header naming the generation of the snapshot
+ * it follows, see `snapshot::save`, followed by a record per edit: its size
+ * and CRC-32, then the row and column of the cell and its new raw text.
+ * Records hold whole raw texts, so replaying an edit twice is harmless.
+ *
+ * Edits are written and synced by a background thread. Edits made while it
+ * syncs are written together by the next sync, so a crash loses at most the
+ * edits of the batch being synced. A record torn by a crash fails its
+ * checksum and is discarded with everything after it.
+ */
+class journal {
+    public:
+        struct header;
+        struct record_header;
+
+        /**
+         * Returns the path of the journal of a snapshot.
+         */
+        static std::string path_of(const std::string& snapshot_path);
+
+        /**
+         * Open or create a journal for appending. Nothing is appended until
+         * `replay` or `reset` tells which snapshot it follows.
+         *
+         * @throws std::system_error Thrown if the file cannot be opened.
+         */
+        journal(const std::string& path) noexcept(false);
+        journal(const journal&) = delete;
+        journal& operator=(const journal&) = delete;
+        /**
+         * Sync the edits appended so far, ignoring errors, and close the file.
+         */
+        ~journal();
+
+        /**
+         * Apply the edits of the journal to a worksheet loaded from the
+         * snapshot of `generation` and recalculate them in the background.
+         *
+         * A journal following another snapshot is already part of it, or
+         * was left by a save which did not finish, and is started over.
+         * Otherwise appending continues after the last valid record.
+         *
+         * @throws std::system_error Thrown if the file cannot be read or
+         *     written.
+         * @returns Number of edits applied.
+         */
+        size_t replay(worksheet& sheet, uint32_t generation) noexcept(false);
+        /**
+         * Apply the edits of the journal at `path` like `replay`, without
+         * opening it for writing. A journal following another snapshot is
+         * ignored and a torn record ends the edits, leaving the file as it is.
+         *
+         * @throws std::system_error Thrown if the file cannot be read.
+         * @returns Number of edits applied.
+         */
+        static size_t apply(worksheet& sheet, const std::string& path, uint32_t generation) noexcept(false);
+
+        /**
+         * Append the edit of a cell. It is written in the background, see
+         * `commit`.
+         */
+        void append(const worksheet::cell_reference& ref, const std::string& raw);
+        /**
+         * Wait for every edit appended so far to be synced to disk.
+         *
+         * @throws std::system_error Thrown if writing or syncing failed
+         *     since the journal was last started over.
+         */
+        void commit() noexcept(false);
+        /**
+         * Start over with no edits after the snapshot of `generation`, once
+         * the snapshot holds them all.
+         *
+         * @throws std::system_error Thrown if the file cannot be written.
+         */
+        void reset(uint32_t generation) noexcept(false);
+
+        /**
+         * Returns the size of the journal in bytes, counting the edits not
+         * synced yet.
+         */
+        uint64_t size() const noexcept;
+    private:
+        std::string path;
+        int fd;
+
+        /// Thread writing and syncing `pending`.
+        std::thread writer;
+        /// Guards every member below.
+        mutable std::mutex mutex;
+        /// Notified when edits are appended or `stopping` is set.
+        std::condition_variable appended_cv;
+        /// Notified when a batch is synced.
+        std::condition_variable synced_cv;
+        /// Encoded records appended and not handed to `writer` yet.
+        std::string pending;
+        /// Whether `writer` is writing a batch.
+        bool writing = false;
+        /// Bytes of the file, counting `pending`.
+        uint64_t file_size = 0;
+        /// First error of `writer`, reported by `commit`.
+        int error = 0;
+        /// Set on destruction to end `writer`.
+        bool stopping = false;
+
+        /// Body of `writer`, syncing batches until `stopping` is set.
+        void run_writer();
+        /**
+         * Empty the file and write a header for `generation` while `mutex`
+         * is held and `writer` is idle.
+         *
+         * @throws std::system_error Thrown if the file cannot be written.
+         */
+        void start_over(uint32_t generation) noexcept(false);
+};
+
+struct journal::header {
+    char magic[8];
+    uint32_t version;
+    /// Generation of the snapshot the edits follow.
+    uint32_t generation;
+};
+
+/**
+ * Start of a record, followed by `size` bytes: the row and column of the
+ * cell as `int32_t` and the raw text.
+ */
+struct journal::record_header {
+    uint32_t size;
+    /// CRC-32 of the `size` bytes.
+    uint32_t checksum;
+};
+
+#endif
@@ -2,7 +2,18 @@
 #include "worksheet_reference.h"
 #include "worksheet.h"
 #include "workspace.h"
+#include "csv.h"
+#include "snapshot.h"
+#include "journal.h"
+#include "event_loop.h"
 #include <execinfo.h>
+#include <csignal>
+#include <cstdlib>
+#include <algorithm>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <system_error>
 #include <unistd.h>
 
 void handler(int sig) {
@@ -18,8 +29,95 @@ void handler(int sig) {
     exit(1);
 }
 
-int main() {
+/// Restore the terminal before being killed by a signal.
+void interrupt_handler(int sig) {
+    terminal::resetTermios();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/**
+ * Load a worksheet from CSV or a snapshot with the edits of its journal,
+ * recalculate it unless it is a snapshot and write the values as CSV or a snapshot, without the terminal.
+ *
+ * @param out_path File to write, or standard output if empty.
+ * @returns Exit status, 1 if a file cannot be opened or a formula cannot be
+ *     parsed.
+ */
+int batch(const std::string& in_path, const std::string& out_path) {
+    // Allocated since the tile index is too large for the stack.
+    auto sheet = std::make_unique<worksheet>();
+    size_t failed = 0;
+    try {
+        if (snapshot::is_snapshot(in_path)) {
+            const uint32_t generation = snapshot::load(*sheet, in_path);
+            // Only read, so a batch run leaves the journal as it is.
+            if (access(journal::path_of(in_path).c_str(), F_OK) == 0) {
+                journal::apply(*sheet, journal::path_of(in_path), generation);
+            }
+        } else {
+            failed = csv::read(*sheet, in_path, std::cerr);
+            sheet->recalculate();
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Cannot read " << e.what() << std::endl;
+        return 1;
+    }
+    sheet->wait_recalculation();
+
+    if (out_path.empty()) {
+        csv::write(*sheet, std::cout);
+        std::cout.flush();
+    } else if (snapshot::is_snapshot(out_path)) {
+        try {
+            snapshot::save(*sheet, out_path);
+        } catch (const std::exception& e) {
+            std::cerr << "Cannot write " << e.what() << std::endl;
+            return 1;
+        }
+    } else {
+        std::ofstream out(out_path, std::ios::binary);
+        if (!out) {
+            std::cerr << "Cannot open " << out_path << std::endl;
+            return 1;
+        }
+        csv::write(*sheet, out, csv::delimiter_of(out_path));
+    }
+    return failed == 0 ? 0 : 1;
+}
+
+int main(int argc, char** argv) {
     signal(SIGABRT, handler);
+    std::optional<std::string> batch_in;
+    std::string batch_out;
+    int max_fps = 60;
+    for (int i=1; i<argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--no-bytecode") worksheet::use_bytecode = false;
+        else if (arg == "--threads" && i+1 < argc) worksheet::thread_count = std::max(std::atoi(argv[++i]), 1);
+        else if (arg == "--batch" && i+1 < argc) batch_in = argv[++i];
+        else if (arg == "--out" && i+1 < argc) batch_out = argv[++i];
+        else if (arg == "--fps" && i+1 < argc) max_fps = std::max(std::atoi(argv[++i]), 1);
+        else workspace::path = arg;
+    }
+    if (batch_in) return batch(*batch_in, batch_out);
+
+    // Set before loading, which may start recalculating already.
+    event_loop::notifier job_ended;
+    workspace::ws.on_job_end = [&]() { job_ended.notify(); };
+    if (!workspace::path.empty()) {
+        try {
+            // Generation 0 when there is no snapshot yet, so only a journal
+            // of edits made before the first one is replayed.
+            uint32_t generation = 0;
+            if (access(workspace::path.c_str(), F_OK) == 0) generation = snapshot::load(workspace::ws, workspace::path);
+            workspace::edits = std::make_unique<journal>(journal::path_of(workspace::path));
+            workspace::edits->replay(workspace::ws, generation);
+        } catch (const std::exception& e) {
+            std::cerr << "Cannot open " << e.what() << std::endl;
+            return 1;
+        }
+    }
     // while (true) {
     //     std::string input;
     //     getline(std::cin, input);
@@ -32,13 +130,39 @@ int main() {
     // std::cout << expression::parse("sum(1, sum(100, 900, 100))")->evaluate() << std::endl;
     // return 0;
 
-    while (true) {
+    // Interval to redraw the progress of a background recalculation.
+    const int recalculation_redraw_ms = 50;
+    terminal::watch_resize();
+    terminal::initTermios();
+    signal(SIGINT, interrupt_handler);
+    signal(SIGTERM, interrupt_handler);
+
+    int progress_timer;
+    event_loop loop(max_fps, [&]() {
         workspace::render();
         terminal::flush();
-
-        char ch = terminal::getch();
-        workspace::action(ch);
-    }
+        if (workspace::ws.recalculating()) loop.start_timer(progress_timer, recalculation_redraw_ms);
+    });
+    progress_timer = loop.add_timer([&]() { loop.request_render(); });
+    loop.watch(STDIN_FILENO, [&]() {
+        // Every key pending is handled before the next render, so a held key
+        // or pasted text costs one frame.
+        const std::string keys = terminal::read_keys(0);
+        // Nothing can be typed any more, and polling an ended input spins.
+        // Exiting syncs the journal and restores the terminal.
+        if (terminal::input_ended()) exit(0);
+        for (char ch : keys) workspace::action(ch);
+        if (!keys.empty()) loop.request_render();
+    });
+    loop.watch(terminal::resize_fd(), [&]() {
+        if (terminal::update_size()) workspace::mark_flush = true;
+        loop.request_render();
+    });
+    loop.watch(job_ended.fd, [&]() {
+        job_ended.clear();
+        loop.request_render();
+    });
+    loop.run();
 
     return 0;
 }
@@ -0,0 +1,33 @@
+#include "mapped_file.h"
+#include <cerrno>
+#include <system_error>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+mapped_file::mapped_file(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw std::system_error(errno, std::generic_category(), path);
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        int err = errno;
+        close(fd);
+        throw std::system_error(err, std::generic_category(), path);
+    }
+    size = st.st_size;
+    if (size > 0) {
+        void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        int err = errno;
+        close(fd);
+        if (mapped == MAP_FAILED) throw std::system_error(err, std::generic_category(), path);
+        madvise(mapped, size, MADV_SEQUENTIAL);
+        data = (const char*)mapped;
+    } else {
+        close(fd);
+    }
+}
+
+mapped_file::~mapped_file() {
+    if (data) munmap((void*)data, size);
+}
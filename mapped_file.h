@@ -0,0 +1,26 @@
+#ifndef __INCLUDE_MAPPED_FILE_
+#define __INCLUDE_MAPPED_FILE_
+
+#include <cstddef>
+#include <string>
+
+/**
+ * A read-only memory mapping of a whole file, unmapped on destruction.
+ */
+struct mapped_file {
+    /// Contents of the file, `nullptr` if it is empty.
+    const char* data = nullptr;
+    size_t size = 0;
+
+    /**
+     * Map a file, advising the kernel that it is read sequentially.
+     *
+     * @throws std::system_error Thrown if the file cannot be opened or mapped.
+     */
+    mapped_file(const std::string& path) noexcept(false);
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+    ~mapped_file();
+};
+
+#endif
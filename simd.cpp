@@ -0,0 +1,180 @@
+#include "simd.h"
+#include <cstring>
+
+#ifdef __x86_64__
+#define SIMD_X86
+#include <immintrin.h>
+#endif
+
+void simd::totals::add(int64_t x) noexcept {
+    sum = (int64_t)((uint64_t)sum + (uint64_t)x);
+    count++;
+    if (x < min) min = x;
+    if (x > max) max = x;
+}
+
+namespace {
+    typedef void (*add_integers_impl)(const int64_t*, const int8_t*, size_t, int8_t, simd::totals&);
+    typedef size_t (*find_type_impl)(const int8_t*, size_t, int8_t);
+    typedef size_t (*count_type_impl)(const int8_t*, size_t, int8_t);
+
+    void add_integers_scalar(const int64_t* data, const int8_t* types, size_t size, int8_t type, simd::totals& t) {
+        for (size_t i=0; i<size; ++i) {
+            if (types[i] == type) t.add(data[i]);
+        }
+    }
+    size_t find_type_scalar(const int8_t* types, size_t size, int8_t type) {
+        const void* found = std::memchr(types, (unsigned char)type, size);
+        return found ? (const int8_t*)found - types : size;
+    }
+    size_t count_type_scalar(const int8_t* types, size_t size, int8_t type) {
+        size_t ans = 0;
+        for (size_t i=0; i<size; ++i) ans += types[i] == type;
+        return ans;
+    }
+
+#ifdef SIMD_X86
+    /**
+     * Fold the lanes of `sum`, `count`, `min` and `max` vectors into `t`.
+     */
+    template<size_t lanes>
+    void fold_lanes(const int64_t (&sum)[lanes], const int64_t (&count)[lanes], const int64_t (&min)[lanes], const int64_t (&max)[lanes], simd::totals& t) {
+        for (size_t i=0; i<lanes; ++i) {
+            t.sum = (int64_t)((uint64_t)t.sum + (uint64_t)sum[i]);
+            t.count += count[i];
+            if (min[i] < t.min) t.min = min[i];
+            if (max[i] > t.max) t.max = max[i];
+        }
+    }
+
+    // SSE4.2 is the first to compare 64-bit integers.
+    __attribute__((target("sse4.2")))
+    void add_integers_sse(const int64_t* data, const int8_t* types, size_t size, int8_t type, simd::totals& t) {
+        const __m128i wanted = _mm_set1_epi64x(type);
+        __m128i sum = _mm_setzero_si128();
+        __m128i count = _mm_setzero_si128();
+        __m128i min = _mm_set1_epi64x(INT64_MAX);
+        __m128i max = _mm_set1_epi64x(INT64_MIN);
+        size_t i = 0;
+        for (; i+2 <= size; i += 2) {
+            int16_t tags;
+            std::memcpy(&tags, types + i, sizeof tags);
+            __m128i mask = _mm_cmpeq_epi64(_mm_cvtepi8_epi64(_mm_cvtsi32_si128(tags)), wanted);
+            __m128i x = _mm_loadu_si128((const __m128i*)(data + i));
+            sum = _mm_add_epi64(sum, _mm_and_si128(mask, x));
+            count = _mm_sub_epi64(count, mask);
+            min = _mm_blendv_epi8(min, x, _mm_and_si128(mask, _mm_cmpgt_epi64(min, x)));
+            max = _mm_blendv_epi8(max, x, _mm_and_si128(mask, _mm_cmpgt_epi64(x, max)));
+        }
+        int64_t lanes[4][2];
+        _mm_storeu_si128((__m128i*)lanes[0], sum);
+        _mm_storeu_si128((__m128i*)lanes[1], count);
+        _mm_storeu_si128((__m128i*)lanes[2], min);
+        _mm_storeu_si128((__m128i*)lanes[3], max);
+        fold_lanes(lanes[0], lanes[1], lanes[2], lanes[3], t);
+        add_integers_scalar(data + i, types + i, size - i, type, t);
+    }
+    size_t find_type_sse(const int8_t* types, size_t size, int8_t type) {
+        const __m128i wanted = _mm_set1_epi8(type);
+        size_t i = 0;
+        for (; i+16 <= size; i += 16) {
+            int hits = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(types + i)), wanted));
+            if (hits) return i + __builtin_ctz(hits);
+        }
+        return i + find_type_scalar(types + i, size - i, type);
+    }
+    size_t count_type_sse(const int8_t* types, size_t size, int8_t type) {
+        const __m128i wanted = _mm_set1_epi8(type);
+        size_t ans = 0, i = 0;
+        for (; i+16 <= size; i += 16) {
+            ans += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(types + i)), wanted)));
+        }
+        return ans + count_type_scalar(types + i, size - i, type);
+    }
+
+    __attribute__((target("avx2")))
+    void add_integers_avx2(const int64_t* data, const int8_t* types, size_t size, int8_t type, simd::totals& t) {
+        const __m256i wanted = _mm256_set1_epi64x(type);
+        __m256i sum = _mm256_setzero_si256();
+        __m256i count = _mm256_setzero_si256();
+        __m256i min = _mm256_set1_epi64x(INT64_MAX);
+        __m256i max = _mm256_set1_epi64x(INT64_MIN);
+        size_t i = 0;
+        for (; i+4 <= size; i += 4) {
+            int32_t tags;
+            std::memcpy(&tags, types + i, sizeof tags);
+            __m256i mask = _mm256_cmpeq_epi64(_mm256_cvtepi8_epi64(_mm_cvtsi32_si128(tags)), wanted);
+            __m256i x = _mm256_loadu_si256((const __m256i*)(data + i));
+            sum = _mm256_add_epi64(sum, _mm256_and_si256(mask, x));
+            count = _mm256_sub_epi64(count, mask);
+            min = _mm256_blendv_epi8(min, x, _mm256_and_si256(mask, _mm256_cmpgt_epi64(min, x)));
+            max = _mm256_blendv_epi8(max, x, _mm256_and_si256(mask, _mm256_cmpgt_epi64(x, max)));
+        }
+        int64_t lanes[4][4];
+        _mm256_storeu_si256((__m256i*)lanes[0], sum);
+        _mm256_storeu_si256((__m256i*)lanes[1], count);
+        _mm256_storeu_si256((__m256i*)lanes[2], min);
+        _mm256_storeu_si256((__m256i*)lanes[3], max);
+        fold_lanes(lanes[0], lanes[1], lanes[2], lanes[3], t);
+        add_integers_scalar(data + i, types + i, size - i, type, t);
+    }
+    __attribute__((target("avx2")))
+    size_t find_type_avx2(const int8_t* types, size_t size, int8_t type) {
+        const __m256i wanted = _mm256_set1_epi8(type);
+        size_t i = 0;
+        for (; i+32 <= size; i += 32) {
+            uint32_t hits = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(types + i)), wanted));
+            if (hits) return i + __builtin_ctz(hits);
+        }
+        return i + find_type_sse(types + i, size - i, type);
+    }
+    __attribute__((target("avx2")))
+    size_t count_type_avx2(const int8_t* types, size_t size, int8_t type) {
+        const __m256i wanted = _mm256_set1_epi8(type);
+        size_t ans = 0, i = 0;
+        for (; i+32 <= size; i += 32) {
+            uint32_t hits = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(types + i)), wanted));
+            ans += __builtin_popcount(hits);
+        }
+        return ans + count_type_sse(types + i, size - i, type);
+    }
+#endif
+
+    /**
+     * Kernels picked for the running CPU.
+     */
+    struct dispatch {
+        add_integers_impl add_integers = add_integers_scalar;
+        find_type_impl find_type = find_type_scalar;
+        count_type_impl count_type = count_type_scalar;
+
+        dispatch() {
+#ifdef SIMD_X86
+            __builtin_cpu_init();
+            // SSE2 is always there on x86-64, which is all the byte kernels need.
+            find_type = find_type_sse;
+            count_type = count_type_sse;
+            if (__builtin_cpu_supports("sse4.2")) add_integers = add_integers_sse;
+            if (__builtin_cpu_supports("avx2")) {
+                add_integers = add_integers_avx2;
+                find_type = find_type_avx2;
+                count_type = count_type_avx2;
+            }
+#endif
+        }
+    };
+    const dispatch& kernels() {
+        static const dispatch instance;
+        return instance;
+    }
+}
+
+void simd::add_integers(const int64_t* data, const int8_t* types, size_t size, int8_t type, totals& t) noexcept {
+    kernels().add_integers(data, types, size, type, t);
+}
+size_t simd::find_type(const int8_t* types, size_t size, int8_t type) noexcept {
+    return kernels().find_type(types, size, type);
+}
+size_t simd::count_type(const int8_t* types, size_t size, int8_t type) noexcept {
+    return kernels().count_type(types, size, type);
+}
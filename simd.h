@@ -0,0 +1,48 @@
+#ifndef __INCLUDE_SIMD_
+#define __INCLUDE_SIMD_
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Vectorized kernels over the typed arrays of `worksheet::tile`, used
+ * by the aggregate functions on ranges.
+ *
+ * Each kernel has AVX2, SSE and scalar implementations. The fastest one the
+ * CPU supports is picked at runtime on first use.
+ */
+struct simd {
+    /**
+     * Running totals of the integers fed to `add_integers`.
+     *
+     * `min` and `max` are only meaningful if `count` is not 0.
+     */
+    struct totals {
+        int64_t sum = 0;
+        int64_t count = 0;
+        int64_t min = INT64_MAX;
+        int64_t max = INT64_MIN;
+
+        /// Add a single integer.
+        void add(int64_t x) noexcept;
+    };
+
+    /**
+     * Add `data[i]` to `t` for every `i < size` with `types[i] == type`.
+     *
+     * Sums wrap around on overflow.
+     */
+    static void add_integers(const int64_t* data, const int8_t* types, size_t size, int8_t type, totals& t) noexcept;
+    /**
+     * Find the first `i < size` with `types[i] == type`.
+     *
+     * @returns `size` if there is none.
+     */
+    static size_t find_type(const int8_t* types, size_t size, int8_t type) noexcept;
+    /**
+     * Count the `i < size` with `types[i] == type`.
+     */
+    static size_t count_type(const int8_t* types, size_t size, int8_t type) noexcept;
+};
+
+#endif
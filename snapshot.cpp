@@ -0,0 +1,333 @@
+#include "snapshot.h"
+#include "bytecode.h"
+#include "mapped_file.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+#include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
+
+void expression::image::add_text(node& n, const std::string& text) {
+    n.a = texts.size();
+    n.size = text.size();
+    texts += text;
+}
+
+int64_t expression::image::pack(const worksheet_reference::cell_reference& ref) noexcept {
+    return (int64_t)ref.row.number << 32 | (uint32_t)ref.col.number;
+}
+
+worksheet_reference::cell_reference expression::image::unpack(int64_t packed) noexcept {
+    return worksheet_reference::cell_reference((int32_t)(packed >> 32), (int32_t)(uint32_t)packed);
+}
+
+void expression::primitive::store(image& img) const {
+    image::node n;
+    const value v = to_value();
+    switch (v.type) {
+        case integer::type: n.type = image::node_type::integer; n.a = v.integer_raw; break;
+        case text::type: n.type = image::node_type::text; img.add_text(n, v.text_raw); break;
+        case boolean::type: n.type = image::node_type::boolean; n.a = v.boolean_raw; break;
+        default: n.type = image::node_type::error; n.a = (int64_t)v.error_raw; break;
+    }
+    img.nodes.push_back(n);
+}
+
+void expression::reference::store(image& img) const {
+    image::node n;
+    n.type = image::node_type::reference;
+    n.a = image::pack(ref);
+    img.nodes.push_back(n);
+}
+
+void expression::range::store(image& img) const {
+    image::node n;
+    n.type = image::node_type::range;
+    n.a = image::pack(ref.first);
+    n.b = image::pack(ref.last);
+    img.nodes.push_back(n);
+}
+
+void expression::function::store(image& img) const {
+    image::node n;
+    n.type = image::node_type::function;
+    n.argc = arg.size();
+    img.add_text(n, name);
+    img.nodes.push_back(n);
+    for (const std::shared_ptr<expression>& exp : arg) {
+        exp->store(img);
+    }
+}
+
+expression::parse_expr expression::image::load(const node*& it, const node* end, const char* texts, size_t size) {
+    if (it >= end) throw std::runtime_error("expression tree past the end of the nodes");
+    const node& n = *it++;
+    auto text_at = [&]() {
+        if (n.a < 0 || (uint64_t)n.a > size || n.size > size - n.a) throw std::runtime_error("text past the end of the texts");
+        return std::string(texts + n.a, n.size);
+    };
+    // Evaluation relies on references inside the worksheet, as parsed.
+    auto cell_at = [&](int64_t packed) {
+        const worksheet_reference::cell_reference ref = unpack(packed);
+        if (!worksheet::contains(ref)) throw std::runtime_error("reference out of the worksheet");
+        return ref;
+    };
+    switch (n.type) {
+        case node_type::integer: return std::make_shared<integer>(n.a);
+        case node_type::text: return std::make_shared<text>(text_at());
+        case node_type::boolean: return std::make_shared<boolean>(n.a != 0);
+        case node_type::error:
+            if (n.a < 0 || n.a > (int64_t)error::values::recur) throw std::runtime_error("unknown error value");
+            return std::make_shared<error>((error::values)n.a);
+        case node_type::reference: return std::make_shared<reference>(cell_at(n.a));
+        case node_type::range: return std::make_shared<range>(worksheet_reference::range_reference(cell_at(n.a), cell_at(n.b)));
+        case node_type::function: {
+            std::string name = text_at();
+            std::vector<parse_expr> arg;
+            arg.reserve(n.argc);
+            for (int i=0; i<n.argc; ++i) arg.push_back(load(it, end, texts, size));
+            return std::make_shared<function>(std::move(name), std::move(arg));
+        }
+    }
+    throw std::runtime_error("unknown expression node");
+}
+
+namespace {
+    const char magic[8] = { 'C', 'S', 'H', 'E', 'E', 'T', '\0', '\x1A' };
+    const uint32_t version = 1;
+    const size_t values_size = worksheet::tile::SIZE * (sizeof(int64_t) + sizeof(int8_t));
+    /// `snapshot::cell_record::node` of the cells which are not formulas.
+    const uint64_t no_node = UINT64_MAX;
+
+    /**
+     * Returns whether `count` items of `item_size` bytes at `offset` are inside
+     * a file of `size` bytes.
+     */
+    bool in_file(uint64_t offset, uint64_t count, uint64_t item_size, uint64_t size) {
+        return offset <= size && count <= (size - offset) / item_size;
+    }
+
+    /**
+     * Flush a file or directory to disk.
+     *
+     * @throws std::system_error Thrown if it cannot be opened or synced.
+     */
+    void sync_file(const std::string& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw std::system_error(errno, std::generic_category(), path);
+        int result = fsync(fd);
+        int err = errno;
+        close(fd);
+        if (result != 0) throw std::system_error(err, std::generic_category(), path);
+    }
+
+    std::string directory_of(const std::string& path) {
+        size_t slash = path.rfind('/');
+        if (slash == std::string::npos) return ".";
+        return slash == 0 ? "/" : path.substr(0, slash);
+    }
+}
+
+bool snapshot::is_snapshot(const std::string& path) noexcept {
+    const std::string extension = ".sheet";
+    return path.size() >= extension.size() && path.compare(path.size() - extension.size(), extension.size(), extension) == 0;
+}
+
+uint32_t snapshot::save(worksheet& sheet, const std::string& path) {
+    sheet.wait_recalculation();
+
+    std::string texts;
+    std::vector<tile_record> tiles;
+    std::vector<text_ref> pools;
+    std::vector<char> values;
+    std::vector<cell_record> cell_records;
+    expression::image img(texts);
+
+    auto add_text = [&](const std::string& text) {
+        text_ref ref = { texts.size(), text.size() };
+        texts += text;
+        return ref;
+    };
+
+    for (int block_col=0; block_col<(int)sheet.cells.tiles.size(); ++block_col) {
+        const auto& block = sheet.cells.tiles[block_col];
+        for (int block_row=0; block_row<(int)block.size(); ++block_row) {
+            if (!block[block_row]) continue;
+            const worksheet::tile& t = *block[block_row];
+            tile_record record = {};
+            record.row = block_row * worksheet::TILE_ROWS;
+            record.col = block_col * worksheet::TILE_COLS;
+            record.values_offset = values.size();
+            record.texts_offset = pools.size();
+
+            // Only the texts in use are written, renumbered in order.
+            std::array<int64_t, worksheet::tile::SIZE> data = t.data;
+            pools.push_back({ 0, 0 });
+            for (int i=0; i<worksheet::tile::SIZE; ++i) {
+                if (t.types[i] != expression::text::type || data[i] == 0) continue;
+                pools.push_back(add_text(t.texts[data[i]]));
+                data[i] = pools.size() - 1 - record.texts_offset;
+            }
+            record.text_count = pools.size() - record.texts_offset;
+            values.insert(values.end(), (const char*)data.data(), (const char*)(data.data() + data.size()));
+            values.insert(values.end(), (const char*)t.types.data(), (const char*)(t.types.data() + t.types.size()));
+            tiles.push_back(record);
+
+            for (int i=0; i<worksheet::tile::SIZE; ++i) {
+                const std::unique_ptr<worksheet::cell>& c = t.cells[i];
+                if (!c || c->raw.empty()) continue;
+                cell_record cr = {};
+                cr.row = c->ref.row.number;
+                cr.col = c->ref.col.number;
+                cr.kind = (uint8_t)c->kind;
+                cr.node = no_node;
+                if (c->kind == worksheet::cell::kind_type::formula) {
+                    cr.raw = add_text(c->raw);
+                    cr.node = img.nodes.size();
+                    c->expr->store(img);
+                } else if (c->kind == worksheet::cell::kind_type::text && t.types[i] == expression::text::type && data[i] != 0 && c->raw[0] != '\'') {
+                    // The value of a text cell without an apostrophe is its raw text, already in the pool.
+                    cr.raw = pools[record.texts_offset + data[i]];
+                } else {
+                    cr.raw = add_text(c->raw);
+                }
+                cell_records.push_back(cr);
+            }
+        }
+    }
+
+    header h = {};
+    std::memcpy(h.magic, magic, sizeof magic);
+    h.version = version;
+    h.tile_rows = worksheet::TILE_ROWS;
+    h.tile_cols = worksheet::TILE_COLS;
+    // Never 0, which is the generation of the worksheet before its first snapshot.
+    std::random_device random;
+    do h.generation = random(); while (h.generation == 0);
+    h.tile_count = tiles.size();
+    h.tiles_offset = sizeof(header);
+    h.cell_count = cell_records.size();
+    h.cells_offset = h.tiles_offset + tiles.size() * sizeof(tile_record);
+    h.node_count = img.nodes.size();
+    h.nodes_offset = h.cells_offset + cell_records.size() * sizeof(cell_record);
+    const uint64_t values_offset = h.nodes_offset + img.nodes.size() * sizeof(expression::image::node);
+    const uint64_t pools_offset = values_offset + values.size();
+    h.texts_size = texts.size();
+    h.texts_offset = pools_offset + pools.size() * sizeof(text_ref);
+    for (tile_record& record : tiles) {
+        record.values_offset += values_offset;
+        record.texts_offset = pools_offset + record.texts_offset * sizeof(text_ref);
+    }
+
+    // Written next to the file and renamed over it, so a failed save keeps
+    // the previous snapshot.
+    const std::string temporary = path + ".tmp";
+    {
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+        auto write = [&](const void* data, size_t size) { out.write((const char*)data, size); };
+        write(&h, sizeof h);
+        write(tiles.data(), tiles.size() * sizeof(tile_record));
+        write(cell_records.data(), cell_records.size() * sizeof(cell_record));
+        write(img.nodes.data(), img.nodes.size() * sizeof(expression::image::node));
+        write(values.data(), values.size());
+        write(pools.data(), pools.size() * sizeof(text_ref));
+        write(texts.data(), texts.size());
+        out.close();
+        if (!out) throw std::system_error(errno, std::generic_category(), temporary);
+    }
+    // Synced first, so a crash after the rename cannot leave a partly written
+    // snapshot which a journal of the new generation refers to.
+    sync_file(temporary);
+    if (std::rename(temporary.c_str(), path.c_str()) != 0) throw std::system_error(errno, std::generic_category(), path);
+    sync_file(directory_of(path));
+    return h.generation;
+}
+
+uint32_t snapshot::load(worksheet& sheet, const std::string& path) {
+    const mapped_file file(path);
+    header h;
+    if (file.size < sizeof h) throw std::runtime_error(path + ": not a snapshot");
+    std::memcpy(&h, file.data, sizeof h);
+    if (std::memcmp(h.magic, magic, sizeof magic) != 0) throw std::runtime_error(path + ": not a snapshot");
+    if (h.version != version || h.tile_rows != worksheet::TILE_ROWS || h.tile_cols != worksheet::TILE_COLS) {
+        throw std::runtime_error(path + ": unsupported snapshot version");
+    }
+    if (!in_file(h.tiles_offset, h.tile_count, sizeof(tile_record), file.size) ||
+        !in_file(h.cells_offset, h.cell_count, sizeof(cell_record), file.size) ||
+        !in_file(h.nodes_offset, h.node_count, sizeof(expression::image::node), file.size) ||
+        !in_file(h.texts_offset, h.texts_size, 1, file.size) ||
+        h.tiles_offset % 8 || h.cells_offset % 8 || h.nodes_offset % 8) {
+        throw std::runtime_error(path + ": truncated snapshot");
+    }
+    const char* texts = file.data + h.texts_offset;
+    auto corrupt = [&]() { return std::runtime_error(path + ": corrupt snapshot"); };
+    auto text = [&](const text_ref& ref) {
+        if (!in_file(ref.offset, ref.size, 1, h.texts_size)) throw corrupt();
+        return std::string(texts + ref.offset, ref.size);
+    };
+
+    // The blocks are aligned in the file, which is mapped at a page boundary.
+    const tile_record* tiles = (const tile_record*)(file.data + h.tiles_offset);
+    for (uint64_t i=0; i<h.tile_count; ++i) {
+        const tile_record& record = tiles[i];
+        const worksheet::cell_reference origin(record.row, record.col);
+        if (!worksheet::contains(origin) || record.row % worksheet::TILE_ROWS || record.col % worksheet::TILE_COLS ||
+            !in_file(record.values_offset, 1, values_size, file.size) ||
+            !in_file(record.texts_offset, record.text_count, sizeof(text_ref), file.size) || record.texts_offset % 8 || record.text_count == 0) {
+            throw corrupt();
+        }
+        worksheet::tile& t = sheet.cells.get_tile(origin);
+        const char* values = file.data + record.values_offset;
+        std::memcpy(t.data.data(), values, sizeof t.data);
+        std::memcpy(t.types.data(), values + sizeof t.data, sizeof t.types);
+        for (int j=0; j<worksheet::tile::SIZE; ++j) {
+            const int8_t type = t.types[j];
+            if (type < expression::integer::type || type > expression::error::type ||
+                (type == expression::text::type && (t.data[j] < 0 || (uint64_t)t.data[j] >= record.text_count))) {
+                throw corrupt();
+            }
+        }
+        const text_ref* pool = (const text_ref*)(file.data + record.texts_offset);
+        t.texts.clear();
+        t.texts.reserve(record.text_count);
+        for (uint64_t j=0; j<record.text_count; ++j) t.texts.push_back(text(pool[j]));
+        t.free_texts.clear();
+    }
+
+    const cell_record* records = (const cell_record*)(file.data + h.cells_offset);
+    const expression::image::node* nodes = (const expression::image::node*)(file.data + h.nodes_offset);
+    for (uint64_t i=0; i<h.cell_count; ++i) {
+        const cell_record& record = records[i];
+        const worksheet::cell_reference ref(record.row, record.col);
+        if (!worksheet::contains(ref) || record.kind > (uint8_t)worksheet::cell::kind_type::formula) throw corrupt();
+        auto loaded = std::make_unique<worksheet::cell>(ref);
+        loaded->raw = text(record.raw);
+        loaded->kind = (worksheet::cell::kind_type)record.kind;
+        switch (loaded->kind) {
+            case worksheet::cell::kind_type::integer: {
+                // The value of an integer cell is the integer itself.
+                const worksheet::tile* t = sheet.cells.find_tile(ref);
+                if (!t || t->types[worksheet::tile::index(ref)] != expression::integer::type) throw corrupt();
+                loaded->expr = std::make_shared<expression::integer>(t->data[worksheet::tile::index(ref)]);
+                break;
+            }
+            case worksheet::cell::kind_type::text:
+                loaded->expr = std::make_shared<expression::text>(worksheet::cell::text_of(loaded->raw));
+                break;
+            case worksheet::cell::kind_type::formula: {
+                if (record.node >= h.node_count) throw corrupt();
+                const expression::image::node* it = nodes + record.node;
+                std::shared_ptr<const expression> expr = expression::image::load(it, nodes + h.node_count, texts, h.texts_size);
+                loaded->program = std::make_shared<const expression::bytecode>(expression::bytecode::compile(*expr));
+                loaded->expr = std::move(expr);
+                break;
+            }
+        }
+        sheet.load_cell(std::move(loaded));
+    }
+    return h.generation;
+}
@@ -0,0 +1,148 @@
+#ifndef __INCLUDE_SNAPSHOT_
+#define __INCLUDE_SNAPSHOT_
+
+#include "expression.h"
+#include "worksheet.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * An expression tree flattened in pre-order, stored in snapshots so that
+ * loading a formula does not parse its text again.
+ */
+struct expression::image {
+    enum struct node_type: uint8_t { integer, text, boolean, error, reference, range, function };
+    /**
+     * A node of the tree. A function node is followed by the trees of its
+     * `argc` arguments.
+     */
+    struct node {
+        node_type type;
+        uint8_t reserved = 0;
+        uint16_t argc = 0;
+        /// Length of the text or function name at offset `a` of the texts.
+        uint32_t size = 0;
+        /**
+         * Integer, boolean or error value, offset of a text or function
+         * name, or for references the row and column of the first cell
+         * packed as `row << 32 | col`.
+         */
+        int64_t a = 0;
+        /// Packed last cell of a range.
+        int64_t b = 0;
+    };
+
+    std::vector<node> nodes;
+    /// Texts the nodes point into.
+    std::string& texts;
+
+    image(std::string& texts): texts(texts) {}
+
+    /// Append a text to `texts` and point `n` at it.
+    void add_text(node& n, const std::string& text);
+    static int64_t pack(const worksheet_reference::cell_reference& ref) noexcept;
+    static worksheet_reference::cell_reference unpack(int64_t packed) noexcept;
+
+    /**
+     * Rebuild the tree starting at `*it`, moving `it` past it.
+     *
+     * @throws std::runtime_error Thrown if the nodes go past `end` or point
+     *     outside the `size` bytes of `texts`.
+     */
+    static parse_expr load(const node*& it, const node* end, const char* texts, size_t size) noexcept(false);
+};
+
+/**
+ * Binary snapshots of a worksheet, which open without parsing or
+ * recalculating anything.
+ *
+ * A snapshot is a header followed by blocks addressed by their offsets in
+ * the file:
+ * - tile records, each with the calculated values and types of a tile
+ *   copied verbatim so they are read in place;
+ * - cell records with the raw texts of the cells and the parsed trees of
+ *   the formulas, the other cells being rebuilt from their values;
+ * - the nodes of the trees, see `expression::image`;
+ * - the texts all the others point into.
+ *
+ * Numbers are stored in the byte order of the machine, so a snapshot is only
+ * meant to be opened on the same kind of machine.
+ */
+namespace snapshot {
+    struct header;
+    struct tile_record;
+    struct cell_record;
+    struct text_ref;
+
+    /**
+     * Returns whether a file name has the extension of snapshots, `.sheet`.
+     */
+    bool is_snapshot(const std::string& path) noexcept;
+
+    /**
+     * Write a snapshot of a worksheet, after waiting for every pending cell
+     * to be calculated. The file is synced to disk before it replaces the
+     * previous snapshot.
+     *
+     * @throws std::system_error Thrown if the file cannot be written.
+     * @returns Generation of the new snapshot, a random number other than 0
+     *     telling it apart from the previous ones, see `journal`.
+     */
+    uint32_t save(worksheet& sheet, const std::string& path) noexcept(false);
+
+    /**
+     * Load a snapshot into an empty worksheet by mapping the file into
+     * memory. The values are taken as they were saved, without
+     * recalculating.
+     *
+     * @throws std::system_error Thrown if the file cannot be read.
+     * @throws std::runtime_error Thrown if the file is not a valid snapshot.
+     * @returns Generation of the snapshot.
+     */
+    uint32_t load(worksheet& sheet, const std::string& path) noexcept(false);
+}
+
+struct snapshot::header {
+    char magic[8];
+    uint32_t version;
+    uint32_t tile_rows;
+    uint32_t tile_cols;
+    /// Random number telling the snapshot apart from the others written to the same path.
+    uint32_t generation;
+    uint64_t tile_count;
+    uint64_t tiles_offset;
+    uint64_t cell_count;
+    uint64_t cells_offset;
+    uint64_t node_count;
+    uint64_t nodes_offset;
+    uint64_t texts_size;
+    uint64_t texts_offset;
+};
+
+/// A text at an offset of the texts block.
+struct snapshot::text_ref {
+    uint64_t offset;
+    uint64_t size;
+};
+
+struct snapshot::tile_record {
+    /// Top left cell of the tile.
+    int32_t row, col;
+    /// Offset of `worksheet::tile::data` followed by `worksheet::tile::types`.
+    uint64_t values_offset;
+    /// Offset of the `text_ref` of each text in the pool of the tile, the first one being the empty text.
+    uint64_t texts_offset;
+    uint64_t text_count;
+};
+
+struct snapshot::cell_record {
+    int32_t row, col;
+    text_ref raw;
+    /// Index of the first node of the tree of a formula.
+    uint64_t node;
+    uint8_t kind;
+    uint8_t reserved[7];
+};
+
+#endif
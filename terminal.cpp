@@ -1,9 +1,14 @@
 #include "terminal.h"
 #include <sys/ioctl.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <csignal>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdexcept>
-#include <iostream>
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
 
 terminal::size terminal::size::operator +(const terminal::size& other) const noexcept {
     return { row + other.row, col + other.col };
@@ -12,25 +17,68 @@ terminal::size terminal::size::operator -(const terminal::size& other) const noe
     return { row - other.row, col - other.col };
 }
 
-void terminal::ansi::flush() { std::cout << std::flush; }
-void terminal::ansi::cursor_up(const int n) { std::cout << CSI << n << "A"; }
-void terminal::ansi::cursor_down(const int n) { std::cout << CSI << n << "B"; }
-void terminal::ansi::cursor_forward(const int n) { std::cout << CSI << n << "C"; }
-void terminal::ansi::cursor_backward(const int n) { std::cout << CSI << n << "D"; }
-void terminal::ansi::cursor_next_line(const int n) { std::cout << CSI << n << "E"; }
-void terminal::ansi::cursor_prev_line(const int n) { std::cout << CSI << n << "E"; }
-void terminal::ansi::cursor_col(const int n) { std::cout << CSI << n+1 << "F"; }
-void terminal::ansi::cursor_pos(const int row, const int col) { std::cout << CSI << row+1 << ';' << col+1 << "H"; }
-void terminal::ansi::erase_display_end() { std::cout << CSI << 'J'; }
-void terminal::ansi::erase_display_begin() { std::cout << CSI << "1;J"; }
-void terminal::ansi::erase_display() { std::cout << CSI << "2;J"; }
-void terminal::ansi::erase_line_end() { std::cout << CSI << 'K'; }
-void terminal::ansi::erase_line_begin() { std::cout << CSI << "1;K"; }
-void terminal::ansi::erase_line() { std::cout << CSI << "2;K"; }
-void terminal::ansi::scroll_up(const int n) { std::cout << CSI << n << 'S'; }
-void terminal::ansi::scroll_down(const int n) { std::cout << CSI << n << 'S'; }
+std::string terminal::ansi::output;
+
+namespace {
+    /**
+     * Attributes the terminal draws with, by their `terminal::palette` index,
+     * as set by the last SGR sequence sent. Reset to the defaults at the end
+     * of every frame, so erasing fills with the default background.
+     */
+    uint8_t sgr_fg = 0, sgr_bg = 0;
+    /// Where the terminal cursor is, `{ -1, -1 }` if unknown.
+    std::pair<int, int> terminal_cursor = { -1, -1 };
+
+    void append_int(std::string& out, int n) {
+        char digits[16];
+        out.append(digits, std::to_chars(digits, digits + sizeof digits, n).ptr);
+    }
+
+    /// Append `CSI n final`.
+    void csi(int n, char final) {
+        terminal::ansi::output += terminal::ansi::CSI;
+        append_int(terminal::ansi::output, n);
+        terminal::ansi::output += final;
+    }
+}
+
+void terminal::ansi::flush() {
+    const char* data = output.data();
+    size_t size = output.size();
+    while (size > 0) {
+        ssize_t written = write(STDOUT_FILENO, data, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        data += written;
+        size -= written;
+    }
+    // Keeps its capacity for the next frame.
+    output.clear();
+}
+void terminal::ansi::cursor_up(const int n) { csi(n, 'A'); }
+void terminal::ansi::cursor_down(const int n) { csi(n, 'B'); }
+void terminal::ansi::cursor_forward(const int n) { csi(n, 'C'); }
+void terminal::ansi::cursor_backward(const int n) { csi(n, 'D'); }
+void terminal::ansi::cursor_next_line(const int n) { csi(n, 'E'); }
+void terminal::ansi::cursor_prev_line(const int n) { csi(n, 'E'); }
+void terminal::ansi::cursor_col(const int n) { csi(n+1, 'F'); }
+void terminal::ansi::cursor_pos(const int row, const int col) {
+    csi(row+1, ';');
+    append_int(output, col+1);
+    output += 'H';
+}
+void terminal::ansi::erase_display_end() { output += CSI + 'J'; }
+void terminal::ansi::erase_display_begin() { output += CSI + "1;J"; }
+void terminal::ansi::erase_display() { output += CSI + "2;J"; }
+void terminal::ansi::erase_line_end() { output += CSI + 'K'; }
+void terminal::ansi::erase_line_begin() { output += CSI + "1;K"; }
+void terminal::ansi::erase_line() { output += CSI + "2;K"; }
+void terminal::ansi::scroll_up(const int n) { csi(n, 'S'); }
+void terminal::ansi::scroll_down(const int n) { csi(n, 'S'); }
 std::pair<int, int> terminal::ansi::report_cursor_flush() {
-    std::cout << CSI << "6n";
+    output += CSI + "6n";
     flush();
     char ch;
     bool esc = false, bracket = false, semicolon = false;
@@ -67,24 +115,107 @@ bool terminal::screen_cell::operator !=(const screen_cell& other) const noexcept
     return !(*this == other);
 }
 
-terminal::screen_cell terminal::screen[1000][1000];
-bool terminal::_unflushed_pos[1000][1000];
+terminal::screen_buffer terminal::screen;
+std::vector<std::optional<terminal::rgb_color>> terminal::palette = { std::nullopt };
+
+void terminal::screen_buffer::reset(const terminal::size& new_size) {
+    buffer_size = { std::max(new_size.row, 0), std::max(new_size.col, 0) };
+    row_words = (buffer_size.col + 63) / 64;
+    cells.assign(buffer_size.row * buffer_size.col, { ' ', 0, 0 });
+    unflushed.assign(buffer_size.row * row_words, 0);
+    unflushed_rows.assign(buffer_size.row, false);
+}
+
+uint8_t terminal::palette_index(const std::optional<rgb_color>& color) {
+    // Few colors are drawn, so searching is cheaper than hashing.
+    for (size_t i=0; i<palette.size(); ++i) {
+        if (palette[i] == color) return i;
+    }
+    if (palette.size() > UINT8_MAX) throw std::length_error("Too many colors");
+    palette.push_back(color);
+    return palette.size() - 1;
+}
 std::pair<int, int> terminal::cursor_pos = {0, 0};
 
+namespace {
+    std::optional<terminal::size> cached_size;
+    /// Set by the `SIGWINCH` handler.
+    volatile sig_atomic_t resized = 0;
+    /**
+     * Pipe the `SIGWINCH` handler writes a byte to, so waiting for input
+     * wakes up whichever thread the signal is delivered to.
+     */
+    int resize_pipe[2] = { -1, -1 };
+
+    terminal::size query_size() noexcept {
+        winsize w = {};
+        ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
+        return { w.ws_row, w.ws_col };
+    }
+
+    void handle_resize(int) {
+        const int saved_errno = errno;
+        resized = 1;
+        if (write(resize_pipe[1], "", 1) < 0) {} // Full pipe already wakes up.
+        errno = saved_errno;
+    }
+
+    /**
+     * Wait until key input is ready or the terminal is resized.
+     *
+     * @returns Whether key input is ready.
+     */
+    bool wait_input_or_resize(int timeout_ms) noexcept {
+        pollfd fds[2] = { { STDIN_FILENO, POLLIN, 0 }, { resize_pipe[0], POLLIN, 0 } };
+        while (true) {
+            int ready = poll(fds, resize_pipe[0] < 0 ? 1 : 2, timeout_ms);
+            if (ready < 0 && errno == EINTR) {
+                if (resized) return false;
+                continue;
+            }
+            // A hang up is read too, to find out that input ended.
+            return ready > 0 && (fds[0].revents & (POLLIN | POLLHUP | POLLERR));
+        }
+    }
+}
+
 terminal::size terminal::getSize() noexcept {
-    winsize w;
-    ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
-    return { w.ws_row, w.ws_col };
+    if (!cached_size) cached_size = query_size();
+    return *cached_size;
+}
+
+void terminal::watch_resize() noexcept {
+    if (pipe2(resize_pipe, O_NONBLOCK | O_CLOEXEC) != 0) return;
+    struct sigaction action = {};
+    action.sa_handler = handle_resize;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGWINCH, &action, nullptr);
+}
+
+int terminal::resize_fd() noexcept {
+    return resize_pipe[0];
+}
+
+bool terminal::update_size() noexcept {
+    if (!resized) return false;
+    resized = 0;
+    char drained[64];
+    while (read(resize_pipe[0], drained, sizeof drained) > 0) {}
+    const size previous = getSize();
+    cached_size = query_size();
+    return cached_size->row != previous.row || cached_size->col != previous.col;
 }
 
 void terminal::set(int r, int c, const std::string& st, const std::optional<rgb_color> fg, const std::optional<rgb_color> bg) noexcept(false) {
-    if (r < 0 || r >= getSize().row || c < 0 || c + st.length() - 1 >= getSize().col)
+    if (r < 0 || r >= screen.buffer_size.row || c < 0 || c + (int)st.length() > screen.buffer_size.col)
         throw std::out_of_range("Position outside screen");
-    for (int i=0; i<st.length(); ++i) {
-        screen_cell data = { st[i], fg, bg };
-        if (screen[r][c+i] != data) {
-            screen[r][c+i] = data;
-            _unflushed_pos[r][c+i] = true;
+    const uint8_t fg_index = palette_index(fg), bg_index = palette_index(bg);
+    for (size_t i=0; i<st.length(); ++i) {
+        screen_cell data = { st[i], fg_index, bg_index };
+        if (screen.at(r, c+i) != data) {
+            screen.at(r, c+i) = data;
+            screen.mark(r, c+i);
         }
     }
 }
@@ -93,65 +224,135 @@ void terminal::set(int r, int c, char ch, const std::optional<rgb_color>& fg, co
 }
 
 void terminal::clear() noexcept {
-    for (int i=0; i<getSize().row; ++i) {
-        for (int j=0; j<getSize().col; ++j) {
-            screen[i][j] = { ' ', {}, {} };
-        }
-    }
+    screen.reset(getSize());
 
     ansi::erase_display();
+    terminal_cursor = { -1, -1 };
 }
 
-void terminal::flush() noexcept {
-    std::pair<int, int> cur_pos = { -1, -1 };
-    for (int r=0; r<getSize().row; ++r) {
-        for (int c=0; c<getSize().col; ++c) {
-            if (!_unflushed_pos[r][c] && !(r == cursor_pos.first && c == cursor_pos.second)) continue;
-            _unflushed_pos[r][c] = false;
-            if (cur_pos.first != r || cur_pos.second != c) {
-                ansi::cursor_pos(r, c);
+namespace {
+    void append_color(std::string& out, const char* prefix, const terminal::rgb_color& color) {
+        out += prefix;
+        append_int(out, color.r);
+        out += ';';
+        append_int(out, color.g);
+        out += ';';
+        append_int(out, color.b);
+    }
+
+    /// Send an SGR sequence changing only the attributes which differ, by their `terminal::palette` index.
+    void set_attributes(uint8_t fg, uint8_t bg) {
+        if (fg == sgr_fg && bg == sgr_bg) return;
+        std::string& out = terminal::ansi::output;
+        out += terminal::ansi::CSI;
+        if (fg == 0 && bg == 0) {
+            out += '0';
+        } else {
+            bool first = true;
+            if (fg != sgr_fg) {
+                if (fg != 0) append_color(out, "38;2;", *terminal::palette[fg]);
+                else out += "39";
+                first = false;
+            }
+            if (bg != sgr_bg) {
+                if (!first) out += ';';
+                if (bg != 0) append_color(out, "48;2;", *terminal::palette[bg]);
+                else out += "49";
             }
+        }
+        out += 'm';
+        sgr_fg = fg;
+        sgr_bg = bg;
+    }
 
-            screen_cell& cell = screen[r][c];
+    void move_cursor(int r, int c) {
+        if (terminal_cursor == std::make_pair(r, c)) return;
+        // Moving forward on the same row is the shorter sequence.
+        if (terminal_cursor.first == r && terminal_cursor.second < c) terminal::ansi::cursor_forward(c - terminal_cursor.second);
+        else terminal::ansi::cursor_pos(r, c);
+        terminal_cursor = { r, c };
+    }
+}
 
-            std::cout << ansi::CSI;
-            if (cell.fg.has_value() && cell.bg.has_value()) {
-                std::cout << "38;2;" << cell.fg.value().r << ';' << cell.fg.value().g << ';' << cell.fg.value().b << ';';
-                std::cout << "48;2;" << cell.bg.value().r << ';' << cell.bg.value().g << ';' << cell.bg.value().b;
-            } else if (cell.fg.has_value()) {
-                std::cout << "38;2;" << cell.fg.value().r << ';' << cell.fg.value().g << ';' << cell.fg.value().b;
-            } else if (cell.bg.has_value()) {
-                std::cout << "48;2;" << cell.bg.value().r << ';' << cell.bg.value().g << ';' << cell.bg.value().b;
-            } else {
-                std::cout << "0";
+void terminal::flush() noexcept {
+    const int cols = screen.buffer_size.col;
+    for (int r=0; r<screen.buffer_size.row; ++r) {
+        if (!screen.unflushed_rows[r]) continue;
+        screen.unflushed_rows[r] = false;
+        for (int w=0; w<screen.row_words; ++w) {
+            uint64_t& bits = screen.unflushed[r * screen.row_words + w];
+            for (; bits != 0; bits &= bits - 1) {
+                const int c = w * 64 + __builtin_ctzll(bits);
+                const screen_cell& cell = screen.at(r, c);
+                move_cursor(r, c);
+                set_attributes(cell.fg, cell.bg);
+                ansi::output += cell.ch;
+                // Writing the last column leaves the cursor there or wraps
+                // depending on the terminal.
+                if (c+1 < cols) terminal_cursor.second++;
+                else terminal_cursor = { -1, -1 };
             }
-            std::cout << "m" << cell.ch << ansi::CSI << "0m";
-
-            cur_pos.second++;
-            if (cur_pos.second == getSize().col) cur_pos = { cur_pos.first+1, 0 };
         }
     }
 
-    ansi::cursor_pos(cursor_pos.first, cursor_pos.second);
+    set_attributes(0, 0);
+    move_cursor(cursor_pos.first, cursor_pos.second);
+    ansi::flush();
 }
 
+struct termios terminal::old, terminal::current;
+
+namespace {
+    bool raw_mode = false;
+    /// Keys read by `read_keys` for `getch` and not returned yet.
+    std::string pending_keys;
+    /// Whether reading key input found its end.
+    bool input_closed = false;
+}
 
 void terminal::initTermios() {
     tcgetattr(0, &old); /* grab old terminal i/o settings */
     current = old; /* make new settings same as old settings */
     current.c_lflag &= ~ICANON; /* disable buffered i/o */
     current.c_lflag &= ~ECHO; /* set no echo mode */
+    // Reads return at once, with nothing if no key is pending.
+    current.c_cc[VMIN] = 0;
+    current.c_cc[VTIME] = 0;
     tcsetattr(0, TCSANOW, &current); /* use these new terminal i/o settings now */
+    if (!raw_mode) atexit(resetTermios);
+    raw_mode = true;
 }
 
 void terminal::resetTermios() {
-    tcsetattr(0, TCSANOW, &old);
+    if (raw_mode) tcsetattr(0, TCSANOW, &old);
+}
+
+std::string terminal::read_keys(int timeout_ms) noexcept {
+    std::string keys;
+    if (!wait_input_or_resize(timeout_ms)) return keys;
+    char buffer[4096];
+    while (true) {
+        ssize_t n = read(STDIN_FILENO, buffer, sizeof buffer);
+        if (n < 0 && errno == EINTR) continue;
+        // Input was ready, so reading nothing at first means it ended.
+        if (keys.empty() && (n == 0 || (n < 0 && errno != EAGAIN))) input_closed = true;
+        if (n <= 0) break;
+        keys.append(buffer, n);
+        if (n < (ssize_t)sizeof buffer) break;
+    }
+    return keys;
 }
 
 char terminal::getch() noexcept {
-    char ch;
-    initTermios();
-    ch = getchar();
-    resetTermios();
+    while (pending_keys.empty()) {
+        pending_keys = read_keys(-1);
+        if (pending_keys.empty()) return 0;
+    }
+    char ch = pending_keys.front();
+    pending_keys.erase(0, 1);
     return ch;
 }
+
+bool terminal::input_ended() noexcept {
+    return input_closed;
+}
@@ -1,8 +1,10 @@
 #ifndef __INCLUDE_TERMINAL_
 #define __INCLUDE_TERMINAL_
 
+#include <cstdint>
 #include <string>
 #include <optional>
+#include <vector>
 #include <termios.h>
 
 /// Utility functions for drawing on the terminal screen.
@@ -10,6 +12,7 @@ namespace terminal { // Forward declare to keep struct declaration at the top le
     struct size;
     struct rgb_color;
     struct screen_cell;
+    struct screen_buffer;
 };
 
 /**
@@ -41,35 +44,71 @@ struct terminal::rgb_color {
 struct terminal::screen_cell {
     /// Character in the cell.
     char ch;
-    /// Foreground color, i.e. the text color.
-    std::optional<rgb_color> fg;
-    /// Background color, i.e. the cell color.
-    std::optional<rgb_color> bg;
+    /// Index in `terminal::palette` of the foreground color, i.e. the text color.
+    uint8_t fg;
+    /// Index in `terminal::palette` of the background color, i.e. the cell color.
+    uint8_t bg;
 
     bool operator==(const screen_cell& other) const noexcept;
     bool operator!=(const screen_cell& other) const noexcept;
 };
 
+/**
+ * Screen cells sized to the screen, together with which of them are to be
+ * flushed.
+ *
+ * Position index is taken as (row, column), with the topmost row being row 0
+ * and the leftmost column being column 0.
+ */
+struct terminal::screen_buffer {
+    /// Number of 64-bit words of `unflushed` per row.
+    int row_words = 0;
+    terminal::size buffer_size = { 0, 0 };
+    /// Cells in row-major order.
+    std::vector<screen_cell> cells;
+    /**
+     * A bit per cell, set if the cell is to be flushed to the screen.
+     * Otherwise, the flushed cell is up to date with the cell.
+     */
+    std::vector<uint64_t> unflushed;
+    /// Whether any bit of a row is set in `unflushed`, so flushing skips the other rows.
+    std::vector<bool> unflushed_rows;
+
+    /**
+     * Resize to `new_size` with every cell blank and flushed.
+     */
+    void reset(const terminal::size& new_size);
+    screen_cell& at(int r, int c) noexcept { return cells[r * buffer_size.col + c]; }
+    /// Mark a cell to be flushed.
+    void mark(int r, int c) noexcept {
+        unflushed[r * row_words + c / 64] |= uint64_t(1) << (c % 64);
+        unflushed_rows[r] = true;
+    }
+};
 namespace terminal {
     struct size;
     struct rgb_color;
     struct screen_cell;
 
     /**
-     * Screen cells buffer to be flushed to the screen.
-     *
-     * Position index is taken as (row, column), with the topmost row being row 0 and the leftmost column being column 0.
+     * Screen cells buffer to be flushed to the screen, resized to the screen
+     * by `clear`.
      */
-    extern screen_cell screen[1000][1000];
+    extern screen_buffer screen;
 
     /**
-     * True if the cell at that position is to be flushed to the screen. 
-     * Otherwise, the flushed cell is up to date with the cell.
+     * Colors of the screen cells by their index in `screen_cell`, index 0
+     * being no color. Colors are added as they are first drawn.
+     */
+    extern std::vector<std::optional<rgb_color>> palette;
+
+    /**
+     * Returns the index of a color in `palette`, adding it if needed.
      *
-     * Position index is taken as (row, column), with the topmost row being
-     * row 0 and the leftmost column being column 0.
+     * @throws std::length_error Thrown if the palette has no room for another
+     *     color.
      */
-    extern bool _unflushed_pos[1000][1000];
+    uint8_t palette_index(const std::optional<rgb_color>& color) noexcept(false);
 
     /**
      * Cursor position to be flushed to the screen.
@@ -82,10 +121,33 @@ namespace terminal {
     /**
      * Retrieve the current screen size.
      *
-     * This is implemeneted with the system `ioctl` function.
+     * The size is queried with the system `ioctl` function the first time and
+     * cached, and only queried again by `update_size` after a resize.
      */
     size getSize() noexcept;
 
+    /**
+     * Start watching for resizes of the terminal with a `SIGWINCH` handler.
+     *
+     * A resize wakes up `getch` and `read_keys` for the caller to redraw.
+     */
+    void watch_resize() noexcept;
+
+    /**
+     * Returns a file descriptor which is readable after a resize until
+     * `update_size`, to wait for resizes with `poll`, or -1 before
+     * `watch_resize`.
+     */
+    int resize_fd() noexcept;
+
+    /**
+     * Query the screen size again if the terminal was resized since the last
+     * call.
+     *
+     * @returns Whether the size changed.
+     */
+    bool update_size() noexcept;
+
     /**
      * Write a string `st` on the screen buffer starting from a screen position.
      * The string is written with left align to the position.
@@ -97,7 +159,8 @@ namespace terminal {
      * @param fg Optional foreground color, i.e. the text color.
      * @param bg Optional background color, i.e. the cell color.
      * @throws std::out_of_range Thrown if any character to be written is out of
-     *     current screen bound.
+     *     the bounds of the screen buffer.
+     * @throws std::length_error Thrown if the colors do not fit in `palette`.
      * @exceptsafe Strong exception safety. Out of bound check is performed before
      *     any modification.
      */
@@ -113,19 +176,24 @@ namespace terminal {
      * @param fg Optional foreground color, i.e. the text color.
      * @param bg Optional background color, i.e. the cell color.
      * @throws std::out_of_range Thrown if the character to be written is out of
-     *     current screen bound.
+     *     the bounds of the screen buffer.
+     * @throws std::length_error Thrown if the colors do not fit in `palette`.
      * @exceptsafe Strong exception safety. Out of bound check is performed before
      *     any modification.
      */
     void set(int r, int c, char ch, const std::optional<rgb_color>& fg = {}, const std::optional<rgb_color>& bg = {}) noexcept(false);
 
     /**
-     * Clear both the terminal screen and screen buffer.
+     * Clear both the terminal screen and screen buffer, resizing the screen
+     * buffer to the screen.
      */
     void clear() noexcept;
 
     /**
      * Flush the screen buffer to the terminal screen.
+     *
+     * Only the cells changed since the last flush are sent, together with
+     * the cursor moves and color changes they need, in a single write.
      */
     void flush() noexcept;
 
@@ -135,21 +203,47 @@ namespace terminal {
      * @see resetTermios
      * @see getch
      */
-    static struct termios old, current;
+    extern struct termios old, current;
 
     // Copied from https://stackoverflow.com/questions/7469139/what-is-the-equivalent-to-getch-getche-in-linux
-    /* Initialize new terminal i/o settings */
+    /**
+     * Initialize new terminal i/o settings for the rest of the session: no
+     * line buffering, no echo, and reads returning at once with whatever
+     * input is pending. The old settings are restored on exit.
+     */
     void initTermios();
 
-    /* Restore old terminal i/o settings */
+    /**
+     * Restore old terminal i/o settings, if `initTermios` changed them.
+     *
+     * This only calls `tcsetattr`, so it may be called from a signal handler.
+     */
     void resetTermios();
 
+    /**
+     * Wait for key input, then read all the keys pending at once, such as a
+     * held key repeating, pasted text or an escape sequence.
+     *
+     * @param timeout_ms Maximum time to wait in milliseconds, or -1 to wait
+     *     until key input.
+     * @returns The keys read, empty on timeout or if the terminal was resized
+     *     meanwhile.
+     */
+    std::string read_keys(int timeout_ms) noexcept;
+
     /**
      * Wait and read a character from key input.
      *
      * This is synchronous and blocks the main thread.
+     *
+     * @returns The character, or 0 if the terminal was resized meanwhile.
      */
     char getch() noexcept;
+    /**
+     * Returns whether `read_keys` found the end of key input, because the
+     * terminal hung up or the input was not a terminal and reached its end.
+     */
+    bool input_ended() noexcept;
 }
 
 /** Define CSI escape keys operations in ANSI.
@@ -159,7 +253,13 @@ namespace terminal::ansi {
     /// Escape sequence to begin a CSI.
     const std::string CSI = "\033[";
 
-    /// Flush the content in `std::cout`. This is not a CSI sequence but idk why i put it here.
+    /**
+     * Output waiting to be sent by `flush`. The sequences below are appended
+     * to it instead of being written one by one.
+     */
+    extern std::string output;
+
+    /// Send `output` to the terminal in one write. This is not a CSI sequence but idk why i put it here.
     void flush();
     void cursor_up(const int n = 1);
     void cursor_down(const int n = 1);
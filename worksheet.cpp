@@ -1,67 +1,198 @@
 #include "worksheet.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <thread>
+#include <unordered_map>
+
+namespace {
+    /**
+     * Same as `std::stoll` consuming the whole text, without throwing for the
+     * texts and formulas which are not integers.
+     */
+    bool parse_integer(const std::string& raw, int64_t& res) noexcept {
+        char* end;
+        errno = 0;
+        res = std::strtoll(raw.c_str(), &end, 10);
+        return end != raw.c_str() && end == raw.c_str() + raw.size() && errno != ERANGE;
+    }
+}
+
+void worksheet::cell::set_raw(const std::string& raw) {
+    int64_t res;
+    if (parse_integer(raw, res)) {
+        expr = std::make_shared<expression::integer>(res);
+        program = nullptr;
+        kind = kind_type::integer;
+        this->raw = raw;
+        return;
+    }
 
-std::shared_ptr<const expression::primitive> worksheet::cell::calculate() {
-    if (calculation_state == calculation_state_type::finished) return value;
-    if (calculation_state == calculation_state_type::in_progress) throw std::make_shared<expression::error>(expression::error::values::recur);
-    calculation_state = calculation_state_type::in_progress;
-    try {
-        std::string::size_type size;
-        std::shared_ptr<expression::primitive> res = std::make_shared<expression::integer>(std::stoll(raw, &size));
-        if (size != raw.size()) throw std::invalid_argument("expect size == trimmed.size()");
-        expr = res;
-        needs_redraw = value != res;
-        value = res;
-        calculation_state = calculation_state_type::finished;
-        return res;
-    } catch (std::exception e) {}
-    
     if (raw.size() == 0 || raw[0] != '=') {
-        std::shared_ptr<expression::primitive> res = std::make_shared<expression::text>(raw);
-        expr = res;
-        needs_redraw = value != res;
-        value = res;
-        calculation_state = calculation_state_type::finished;
-        return res;
+        expr = std::make_shared<expression::text>(text_of(raw));
+        program = nullptr;
+        kind = kind_type::text;
+        this->raw = raw;
+        return;
     }
 
-    expr = expression::parse(raw.substr(1, raw.length() - 1));
-    std::shared_ptr<const expression::primitive> res;
-    try {
-        res = expr->evaluate();
-    } catch (std::shared_ptr<expression::error> e) {
-        res = e;
-        needs_redraw = value != res;
-        value = res;
-        calculation_state = calculation_state_type::finished;
-        throw e;
+    std::shared_ptr<const expression> parsed = expression::parse(raw.substr(1, raw.length() - 1));
+    program = std::make_shared<const expression::bytecode>(expression::bytecode::compile(*parsed));
+    expr = parsed;
+    kind = kind_type::formula;
+    this->raw = raw;
+}
+
+std::string worksheet::cell::text_of(const std::string& raw) {
+    if (!raw.empty() && raw[0] == '\'') return raw.substr(1);
+    return raw;
+}
+
+std::string worksheet::cell::raw_of_text(const std::string& text) {
+    int64_t res;
+    if ((!text.empty() && (text[0] == '=' || text[0] == '\'')) || parse_integer(text, res)) return '\'' + text;
+    return text;
+}
+
+bool worksheet::use_bytecode = true;
+unsigned int worksheet::thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+const expression::value worksheet::recur_error = expression::value::of_error(expression::error::values::recur);
+
+const std::shared_ptr<const expression> worksheet::cell::empty_text = std::make_shared<const expression::text>("");
+
+worksheet::tile::tile() {
+    data.fill(0);
+    types.fill(int8_t(expression::text::type));
+    states.fill(calculation_state_type::finished);
+}
+
+expression::value worksheet::tile::get(int index) const noexcept {
+    std::lock_guard<std::mutex> lock(mutex);
+    switch (types[index]) {
+        case expression::integer::type: return expression::value::of_integer(data[index]);
+        case expression::text::type: return expression::value::of_text(texts[data[index]]);
+        case expression::boolean::type: return expression::value::of_boolean(data[index]);
+        default: return expression::value::of_error((expression::error::values)data[index]);
+    }
+}
+
+void worksheet::tile::set(int index, const expression::value& value) {
+    std::lock_guard<std::mutex> lock(mutex);
+    states[index] = calculation_state_type::finished;
+    if (types[index] == expression::text::type && data[index] != 0) {
+        free_texts.push_back(data[index]);
+    }
+    types[index] = value.type;
+    switch (value.type) {
+        case expression::integer::type: data[index] = value.integer_raw; break;
+        case expression::boolean::type: data[index] = value.boolean_raw; break;
+        case expression::error::type: data[index] = (int64_t)value.error_raw; break;
+        case expression::text::type:
+            if (value.text_raw.empty()) {
+                data[index] = 0;
+            } else if (!free_texts.empty()) {
+                data[index] = free_texts.back();
+                free_texts.pop_back();
+                texts[data[index]] = value.text_raw;
+            } else {
+                data[index] = texts.size();
+                texts.push_back(value.text_raw);
+            }
+            break;
     }
+}
+
+bool worksheet::tile::stale(int index) const noexcept {
+    std::lock_guard<std::mutex> lock(mutex);
+    return states[index] == calculation_state_type::pending;
+}
+
+worksheet::tile* worksheet::grid::find_tile(const cell_reference& ref) const noexcept {
+    if (!contains(ref)) return nullptr;
+    const std::vector<std::unique_ptr<tile>>& block = tiles[ref.col.number / TILE_COLS];
+    if (block.empty()) return nullptr;
+    return block[ref.row.number / TILE_ROWS].get();
+}
+
+worksheet::tile& worksheet::grid::get_tile(const cell_reference& ref) {
+    std::vector<std::unique_ptr<tile>>& block = tiles[ref.col.number / TILE_COLS];
+    if (block.empty()) block.resize(MAX_ROW / TILE_ROWS);
+    std::unique_ptr<tile>& t = block[ref.row.number / TILE_ROWS];
+    if (!t) t = std::make_unique<tile>();
+    return *t;
+}
 
-    needs_redraw = value != res;
-    value = res;
-    calculation_state = calculation_state_type::finished;
-    return res;
+worksheet::cell* worksheet::grid::find(const cell_reference& ref) const noexcept {
+    tile* t = find_tile(ref);
+    return t ? t->cells[tile::index(ref)].get() : nullptr;
 }
 
-worksheet::worksheet() {
-    for (int i=0; i<MAX_ROW; ++i) col_width[i] = 10;
-    for (int i=0; i<MAX_COL; ++i) row_height[i] = 3;
+worksheet::cell& worksheet::grid::operator[](const cell_reference& ref) {
+    std::unique_ptr<cell>& target = get_tile(ref).cells[tile::index(ref)];
+    if (!target) target = std::make_unique<cell>(ref);
+    return *target;
+}
+
+expression::value worksheet::value_at(const cell_reference& ref) const noexcept {
+    const tile* t = cells.find_tile(ref);
+    return t ? t->get(tile::index(ref)) : expression::value();
+}
+
+void worksheet::calculate(const cell_reference& ref, expression::context& ctx) noexcept {
+    const cell& target = cells[ref];
+    expression::value res = (use_bytecode && target.program) ? target.program->run(ctx) : target.expr->evaluate(ctx);
+    // A range is only meaningful as an argument of an aggregate.
+    if (res.is_type<expression::range>()) res = expression::value::of_error(expression::error::values::value);
+    store(ref, res);
+}
+
+void worksheet::store(const cell_reference& ref, const expression::value& value) {
+    cells.get_tile(ref).set(tile::index(ref), value);
+    // Redrawn even if unchanged since it was shown as stale.
+    cells[ref].needs_redraw = true;
+}
+
+bool worksheet::is_stale(const cell_reference& ref) const noexcept {
+    const tile* t = cells.find_tile(ref);
+    return t && t->stale(tile::index(ref));
+}
+
+int worksheet::col_width(int col) const noexcept {
+    auto it = col_widths.find(col);
+    return it == col_widths.end() ? default_col_width : it->second;
+}
+int worksheet::row_height(int row) const noexcept {
+    auto it = row_heights.find(row);
+    return it == row_heights.end() ? default_row_height : it->second;
+}
+int worksheet::row_start(int row) const noexcept {
+    const int i = row - top_left.row.number;
+    if (i < 0 || i >= (int)row_starts.size()) return std::max(bufsize.row, 0) + 1;
+    return row_starts[i];
+}
+int worksheet::col_start(int col) const noexcept {
+    const int i = col - top_left.col.number;
+    if (i < 0 || i >= (int)col_starts.size()) return std::max(bufsize.col, 0) + 1;
+    return col_starts[i];
 }
 
 void worksheet::update_row_start() {
-    for (int i=0, r=header_row_height+1; i<MAX_ROW; r += row_height[i] + 1, i++) {
-        row_start[i] = r;
+    row_starts.clear();
+    for (int i=top_left.row.number, r=header_row_height+1; i<MAX_ROW && r<bufsize.row; r += row_height(i) + 1, i++) {
+        row_starts.push_back(r);
     }
 }
 void worksheet::update_col_start() {
-    for (int i=0, c=header_col_width+1; i<MAX_COL; c += col_width[i] + 1, i++) {
-        col_start[i] = c;
+    col_starts.clear();
+    for (int i=top_left.col.number, c=header_col_width+1; i<MAX_COL && c<bufsize.col; c += col_width(i) + 1, i++) {
+        col_starts.push_back(c);
     }
 }
 
 void worksheet::draw_row_lines() {
-    for (int i=0; i<MAX_ROW; ++i) {
-        int r = row_start[i]-1;
-        if (r >= bufsize.row) break;
+    for (int start : row_starts) {
+        int r = start-1;
         for (int c=0; c<bufsize.col; ++c) {
             terminal::set(r, c, ' ', {}, border_color);
         }
@@ -69,9 +200,8 @@ void worksheet::draw_row_lines() {
 }
 
 void worksheet::draw_col_lines() {
-    for (int i=0; i<MAX_COL; ++i) {
-        int c = col_start[i]-1;
-        if (c >= bufsize.col) break;
+    for (int start : col_starts) {
+        int c = start-1;
         for (int r=0; r<bufsize.row; ++r) {
             terminal::set(r, c, ' ', {}, border_color);
         }
@@ -89,24 +219,24 @@ void worksheet::draw_header_row(col_reference col, bool is_active) {
     }
 
     for (int j=0; j<std::min(bufsize.row, header_row_height); ++j) {
-        for (int k=col_start[col.number]; k<std::min(bufsize.col, col_start[col.number]+col_width[col.number]); ++k) {
+        for (int k=col_start(col.number); k<std::min(bufsize.col, col_start(col.number)+col_width(col.number)); ++k) {
             terminal::set(j, k, ' ', {}, bg);
         }
     }
 
-    int width = std::min(col_width[col.number], bufsize.col - col_start[col.number]);
+    int width = std::min(col_width(col.number), bufsize.col - col_start(col.number));
     std::string code = col.to_code();
     try {
         if ((int)code.length() > width) { // Yes, that (int) costs me 15 mintues of debugging
             for (int j=0; j<width; ++j) {
-                terminal::set(header_row_height-1, col_start[col.number]+width-1-j, code[code.length()-1-j], fg, bg);
+                terminal::set(header_row_height-1, col_start(col.number)+width-1-j, code[code.length()-1-j], fg, bg);
             }
         } else {
-            for (int j=0; j<code.length(); ++j) {
-                terminal::set(header_row_height-1, col_start[col.number]+(width-code.length())/2+j, code[j], fg, bg);
+            for (size_t j=0; j<code.length(); ++j) {
+                terminal::set(header_row_height-1, col_start(col.number)+(width-code.length())/2+j, code[j], fg, bg);
             }
         }
-    } catch (std::out_of_range e) {
+    } catch (const std::out_of_range& e) {
         std::cout << width << ' ' << code.length();
         exit(0);
     }
@@ -123,34 +253,34 @@ void worksheet::draw_header_col(row_reference row, bool is_active) {
     }
 
     for (int j=0; j<std::min(bufsize.col, header_col_width); ++j) {
-        for (int k=row_start[row.number]; k<std::min(bufsize.row, row_start[row.number]+row_height[row.number]); ++k) {
+        for (int k=row_start(row.number); k<std::min(bufsize.row, row_start(row.number)+row_height(row.number)); ++k) {
             terminal::set(k, j, ' ', {}, bg);
         }
     }
 
-    int height = std::min(row_height[row.number], bufsize.row - row_start[row.number]);
+    int height = std::min(row_height(row.number), bufsize.row - row_start(row.number));
     std::string code = row.to_code();
-    if (row_start[row.number] + height/2 < bufsize.row) {
+    if (row_start(row.number) + height/2 < bufsize.row) {
         for (int j=0; j<std::min((int)code.length(), header_col_width); ++j) {
-            terminal::set(row_start[row.number] + height/2, header_col_width-1-j, code[code.length()-1-j], fg, bg);
+            terminal::set(row_start(row.number) + height/2, header_col_width-1-j, code[code.length()-1-j], fg, bg);
         }
     }
 }
 
 void worksheet::draw_cell_borders(const cell_reference& cell, const std::optional<terminal::rgb_color> bg) {
-    int active_r = row_start[cell.row.number];
-    int active_c = col_start[cell.col.number];
-    for (int r=active_r-1; r<=std::min(bufsize.row-1, active_r+row_height[cell.row.number]); ++r) {
+    int active_r = row_start(cell.row.number);
+    int active_c = col_start(cell.col.number);
+    for (int r=active_r-1; r<=std::min(bufsize.row-1, active_r+row_height(cell.row.number)); ++r) {
         if (active_c-1 < bufsize.col)
             terminal::set(r, active_c-1, ' ', {}, bg);
-        if (active_c + col_width[cell.col.number] < bufsize.col)
-            terminal::set(r, active_c+col_width[cell.col.number], ' ', {}, bg);
+        if (active_c + col_width(cell.col.number) < bufsize.col)
+            terminal::set(r, active_c+col_width(cell.col.number), ' ', {}, bg);
     }
-    for (int c=active_c-1; c<=std::min(bufsize.col-1, active_c+col_width[cell.col.number]); ++c) {
+    for (int c=active_c-1; c<=std::min(bufsize.col-1, active_c+col_width(cell.col.number)); ++c) {
         if (active_r-1 < bufsize.row)
             terminal::set(active_r-1, c, ' ', {}, bg);
-        if (active_r + row_height[cell.row.number] < bufsize.row)
-            terminal::set(active_r+row_height[cell.row.number], c, ' ', {}, bg);
+        if (active_r + row_height(cell.row.number) < bufsize.row)
+            terminal::set(active_r+row_height(cell.row.number), c, ' ', {}, bg);
     }
 }
 void worksheet::draw_active_borders(const cell_reference& active_cell) {
@@ -158,11 +288,13 @@ void worksheet::draw_active_borders(const cell_reference& active_cell) {
 }
 
 void worksheet::draw_cell_text(const cell_reference& cell) {
-    int width = std::min(col_width[cell.col.number], bufsize.col - col_start[cell.col.number]);
-    int height = std::min(row_height[cell.row.number], bufsize.row - row_start[cell.row.number]);
+    int width = std::min(col_width(cell.col.number), bufsize.col - col_start(cell.col.number));
+    int height = std::min(row_height(cell.row.number), bufsize.row - row_start(cell.row.number));
     if (width <= 0 || height <= 0) return;
-    std::string content = cells[cell].value->cell_value(width);
-    terminal::set(row_start[cell.row.number] + height/2, col_start[cell.col.number], content);
+    std::string content = value_at(cell).cell_value(width);
+    std::optional<terminal::rgb_color> fg;
+    if (is_stale(cell)) fg = stale_fg_color;
+    terminal::set(row_start(cell.row.number) + height/2, col_start(cell.col.number), content, fg);
 }
 
 void worksheet::redraw() {
@@ -170,26 +302,24 @@ void worksheet::redraw() {
     draw_col_lines();
 
     if (header_row_height > 0) {
-        for (col_reference i(0); i.number<MAX_COL; ++i) {
-            if (col_start[i.number] >= bufsize.col) break;
-            draw_header_row(i, i == active_cell.col);
+        for (int i=0; i<(int)col_starts.size(); ++i) {
+            col_reference col = top_left.col + i;
+            draw_header_row(col, col == active_cell.col);
         }
     }
 
     if (header_col_width > 0) {
-        for (row_reference i(0); i.number<MAX_ROW; ++i) {
-            if (row_start[i.number] >= bufsize.row) break;
-            draw_header_col(i, i == active_cell.row);
+        for (int i=0; i<(int)row_starts.size(); ++i) {
+            row_reference row = top_left.row + i;
+            draw_header_col(row, row == active_cell.row);
         }
     }
 
     draw_active_borders(active_cell);
 
-    for (row_reference r(0); r.number<MAX_ROW; ++r) {
-        if (row_start[r.number] >= bufsize.row) break;
-        for (col_reference c(0); c.number<MAX_COL; ++c) {
-            if (col_start[c.number] >= bufsize.col) break;
-            draw_cell_text(cell_reference(r, c));
+    for (int i=0; i<(int)row_starts.size(); ++i) {
+        for (int j=0; j<(int)col_starts.size(); ++j) {
+            draw_cell_text(cell_reference(top_left.row + i, top_left.col + j));
         }
     }
 }
@@ -206,26 +336,570 @@ void worksheet::update_active_cell(const cell_reference& oldValue, const cell_re
 }
 
 void worksheet::update_needs_redraw_cell() {
-    for (row_reference r(0); r.number<MAX_ROW; ++r) {
-        for (col_reference c(0); c.number<MAX_COL; ++c) {
-            if (!cells[r][c].needs_redraw) continue;
-            draw_cell_text(cell_reference(r, c));
+    for (int i=0; i<(int)row_starts.size(); ++i) {
+        for (int j=0; j<(int)col_starts.size(); ++j) {
+            cell_reference ref(top_left.row + i, top_left.col + j);
+            cell* target = cells.find(ref);
+            // Cleared before drawing so a value stored meanwhile is drawn next time.
+            if (!target || !target->needs_redraw.exchange(false)) continue;
+            draw_cell_text(ref);
         }
     }
 }
 
+bool worksheet::scroll_to(const cell_reference& ref) noexcept {
+    // Only count the rows and columns which fit entirely on the screen.
+    int visible_rows = 0, visible_cols = 0;
+    for (int i=0; i<(int)row_starts.size(); ++i) {
+        if (row_starts[i] + row_height(top_left.row.number + i) <= bufsize.row) visible_rows++;
+    }
+    for (int i=0; i<(int)col_starts.size(); ++i) {
+        if (col_starts[i] + col_width(top_left.col.number + i) <= bufsize.col) visible_cols++;
+    }
+    visible_rows = std::max(visible_rows, 1);
+    visible_cols = std::max(visible_cols, 1);
+
+    cell_reference old = top_left;
+    if (ref.row < top_left.row) top_left.row = ref.row;
+    else if (ref.row.number >= top_left.row.number + visible_rows) top_left.row = ref.row - (visible_rows - 1);
+    if (ref.col < top_left.col) top_left.col = ref.col;
+    else if (ref.col.number >= top_left.col.number + visible_cols) top_left.col = ref.col - (visible_cols - 1);
+    return top_left != old;
+}
+
 void worksheet::recalculate() {
-    for (row_reference r(0); r.number<MAX_ROW; ++r) {
-        for (col_reference c(0); c.number<MAX_COL; ++c) {
-            cells[r][c].calculation_state = cell::calculation_state_type::pending;
-            cells[r][c].needs_redraw = false;
+    cancel_recalculation();
+    deferred.clear();
+    cells.for_each_tile([&](tile& t) {
+        std::lock_guard<std::mutex> lock(t.mutex);
+        for (int i=0; i<tile::SIZE; ++i) {
+            if (!t.cells[i]) continue;
+            t.states[i] = calculation_state_type::pending;
+            t.cells[i]->needs_redraw = true;
+            deferred.insert(cell_key(t.cells[i]->ref));
+        }
+    });
+    start_recalculation(visible_range());
+}
+
+bool worksheet::contains(const cell_reference& ref) noexcept {
+    return ref.row.number >= 0 && ref.row.number < MAX_ROW && ref.col.number >= 0 && ref.col.number < MAX_COL;
+}
+
+void worksheet::update_precedents(const cell_reference& ref) {
+    cell& target = cells[ref];
+    for (const cell_reference& old : target.precedents) {
+        std::vector<cell_reference>& deps = cells[old].dependents;
+        deps.erase(std::remove(deps.begin(), deps.end(), ref), deps.end());
+    }
+    target.precedents.clear();
+    for (const range_reference& old : target.range_precedents) {
+        for_each_range_list(old, [&](std::vector<range_edge>& edges, int level) {
+            const size_t size = edges.size();
+            edges.erase(std::remove_if(edges.begin(), edges.end(), [&](const range_edge& edge) {
+                return edge.dependent == ref && edge.range == old;
+            }), edges.end());
+            if (level >= 0) level_edges[level] -= size - edges.size();
+        });
+    }
+    target.range_precedents.clear();
+
+    std::vector<cell_reference> refs;
+    std::vector<range_reference> ranges;
+    target.expr->collect_references(refs, ranges);
+
+    // References are inside the worksheet, as the parser and snapshots check.
+    for (const cell_reference& precedent : refs) {
+        if (std::find(target.precedents.begin(), target.precedents.end(), precedent) != target.precedents.end()) continue;
+        target.precedents.push_back(precedent);
+        cells[precedent].dependents.push_back(ref);
+    }
+    for (const range_reference& range : ranges) {
+        if (std::find(target.range_precedents.begin(), target.range_precedents.end(), range) != target.range_precedents.end()) continue;
+        target.range_precedents.push_back(range);
+        for_each_range_list(range, [&](std::vector<range_edge>& edges, int level) {
+            edges.push_back({ range, ref });
+            if (level >= 0) level_edges[level]++;
+        });
+    }
+}
+
+int64_t worksheet::bucket_key(int level, int row, int col) noexcept {
+    return ((int64_t)level * MAX_COL + col) * (MAX_ROW / RANGE_BUCKET_ROWS) + (row / RANGE_BUCKET_ROWS >> level);
+}
+
+template<typename F>
+void worksheet::for_each_range_list(const range_reference& range, F f) {
+    // Aligned buckets covering the rows, found bottom up as in a segment tree.
+    std::vector<std::pair<int, int>> buckets;
+    int low = range.first.row.number / RANGE_BUCKET_ROWS, high = range.last.row.number / RANGE_BUCKET_ROWS + 1;
+    for (int level = 0; low < high; ++level, low >>= 1, high >>= 1) {
+        if (low & 1) buckets.emplace_back(level, low++);
+        if (high & 1) buckets.emplace_back(level, --high);
+    }
+    const int first_col = range.first.col.number, last_col = range.last.col.number;
+    if ((int64_t)buckets.size() * (last_col - first_col + 1) > MAX_INDEXED_BUCKETS) {
+        f(large_range_dependents, -1);
+        return;
+    }
+    for (int c = first_col; c <= last_col; ++c) {
+        for (const auto& [level, index] : buckets) {
+            f(range_dependents[bucket_key(level, (index << level) * RANGE_BUCKET_ROWS, c)], level);
+        }
+    }
+}
+
+template<typename F>
+void worksheet::for_each_dependent(const cell_reference& ref, F f) {
+    for (const cell_reference& dependent : cells[ref].dependents) f(dependent);
+    for (int level = 0; level < RANGE_BUCKET_LEVELS; ++level) {
+        if (level_edges[level] == 0) continue;
+        auto it = range_dependents.find(bucket_key(level, ref.row.number, ref.col.number));
+        if (it == range_dependents.end()) continue;
+        for (const range_edge& edge : it->second) {
+            if (edge.range.contains(ref)) f(edge.dependent);
+        }
+    }
+    for (const range_edge& edge : large_range_dependents) {
+        if (edge.range.contains(ref)) f(edge.dependent);
+    }
+}
+
+void worksheet::set_raw(const cell_reference& ref, const std::string& raw) {
+    cancel_recalculation();
+    try {
+        cells[ref].set_raw(raw);
+    } catch (...) {
+        start_recalculation(visible_range());
+        throw;
+    }
+    update_precedents(ref);
+    mark_pending(ref);
+    start_recalculation(visible_range());
+}
+
+void worksheet::load_raw(const cell_reference& ref, const std::string& raw) {
+    cancel_recalculation();
+    cells[ref].set_raw(raw);
+    update_precedents(ref);
+}
+
+void worksheet::load_cell(std::unique_ptr<cell> loaded) {
+    cancel_recalculation();
+    std::unique_ptr<cell>& target = cells.get_tile(loaded->ref).cells[tile::index(loaded->ref)];
+    if (!target) {
+        target = std::move(loaded);
+    } else {
+        // Keep the edges of the existing cell, which `update_precedents` replaces.
+        target->raw = std::move(loaded->raw);
+        target->kind = loaded->kind;
+        target->expr = std::move(loaded->expr);
+        target->program = std::move(loaded->program);
+    }
+    update_precedents(target->ref);
+}
+
+void worksheet::recalculate(const cell_reference& changed) {
+    cancel_recalculation();
+    mark_pending(changed);
+    start_recalculation(visible_range());
+}
+
+void worksheet::recalculate(const std::vector<cell_reference>& changed) {
+    cancel_recalculation();
+    for (const cell_reference& ref : changed) mark_pending(ref);
+    start_recalculation(visible_range());
+}
+
+void worksheet::mark_pending(const cell_reference& changed) {
+    // Collect the transitive dependents of the changed cell. Cells already
+    // pending are in `deferred` together with their dependents.
+    std::vector<cell_reference> dirty;
+    auto mark = [&](const cell_reference& ref) {
+        tile& t = cells.get_tile(ref);
+        std::lock_guard<std::mutex> lock(t.mutex);
+        calculation_state_type& state = t.states[tile::index(ref)];
+        if (state == calculation_state_type::pending) return;
+        state = calculation_state_type::pending;
+        deferred.insert(cell_key(ref));
+        dirty.push_back(ref);
+    };
+    mark(changed);
+    for (size_t i=0; i<dirty.size(); ++i) {
+        // Copied since pushing to `dirty` may move it.
+        const cell_reference ref = dirty[i];
+        for_each_dependent(ref, mark);
+    }
+    for (const cell_reference& ref : dirty) cells[ref].needs_redraw = true;
+}
+
+worksheet::range_reference worksheet::visible_range() const noexcept {
+    const int rows = std::max((int)row_starts.size(), 1), cols = std::max((int)col_starts.size(), 1);
+    return range_reference(top_left, cell_reference(
+        std::min(top_left.row.number + rows - 1, MAX_ROW - 1),
+        std::min(top_left.col.number + cols - 1, MAX_COL - 1)));
+}
+
+void worksheet::calculate_visible() {
+    const range_reference visible = visible_range();
+    if (job_targets == visible) return;
+    cancel_recalculation();
+    start_recalculation(visible);
+}
+
+void worksheet::start_recalculation(std::optional<range_reference> targets) {
+    job_targets = targets;
+    if (deferred.empty()) return;
+    std::lock_guard<std::mutex> lock(worker_mutex);
+    job_running = true;
+    if (!worker.joinable()) worker = std::thread(&worksheet::run_worker, this);
+    worker_cv.notify_all();
+}
+
+std::vector<worksheet::cell_reference> worksheet::job_cells() const {
+    auto is_pending = [this](const cell_reference& ref) {
+        const tile* t = cells.find_tile(ref);
+        return t && t->states[tile::index(ref)] == calculation_state_type::pending;
+    };
+    std::vector<cell_reference> ans;
+    if (!job_targets) {
+        ans.reserve(deferred.size());
+        for (int64_t key : deferred) ans.emplace_back(key / MAX_COL, key % MAX_COL);
+        return ans;
+    }
+
+    // Search the pending precedents of the targets. Finished cells only
+    // have finished precedents, so the search stops at them.
+    std::unordered_set<int64_t> seen;
+    auto visit = [&](const cell_reference& ref) {
+        if (seen.insert((int64_t)ref.row.number * MAX_COL + ref.col.number).second) ans.push_back(ref);
+    };
+    auto visit_range = [&](const range_reference& range) {
+        for (int col = range.first.col.number; col <= range.last.col.number; ++col) {
+            for_each_column_run(col, range.first.row.number, range.last.row.number, [&](tile& t, int index, int n) {
+                for (int i=index; i<index+n; ++i) {
+                    if (t.states[i] == calculation_state_type::pending && t.cells[i]) visit(t.cells[i]->ref);
+                }
+            });
+        }
+    };
+    visit_range(*job_targets);
+    for (size_t i=0; i<ans.size() && !cancel_requested; ++i) {
+        const cell* target = cells.find(ans[i]);
+        for (const cell_reference& precedent : target->precedents) {
+            if (is_pending(precedent)) visit(precedent);
+        }
+        for (const range_reference& range : target->range_precedents) visit_range(range);
+    }
+    return ans;
+}
+
+void worksheet::run_worker() {
+    std::unique_lock<std::mutex> lock(worker_mutex);
+    while (true) {
+        worker_cv.wait(lock, [this]() { return job_running || stopping; });
+        if (stopping) return;
+        lock.unlock();
+        std::vector<cell_reference> dirty = job_cells();
+        if (!cancel_requested) calculate_levels(dirty);
+        for (const cell_reference& ref : dirty) {
+            if (cells.find_tile(ref)->states[tile::index(ref)] == calculation_state_type::finished) deferred.erase(cell_key(ref));
+        }
+        lock.lock();
+        job_running = false;
+        worker_cv.notify_all();
+        if (on_job_end) {
+            lock.unlock();
+            on_job_end();
+            lock.lock();
         }
     }
-    for (row_reference r(0); r.number<MAX_ROW; ++r) {
-        for (col_reference c(0); c.number<MAX_COL; ++c) {
-            try {
-                cells[r][c].calculate();
-            } catch (std::shared_ptr<expression::error> e) {}
+}
+
+void worksheet::cancel_recalculation() {
+    std::unique_lock<std::mutex> lock(worker_mutex);
+    cancel_requested = true;
+    worker_cv.wait(lock, [this]() { return !job_running; });
+    cancel_requested = false;
+}
+
+int64_t worksheet::cell_key(const cell_reference& ref) noexcept {
+    return (int64_t)ref.row.number * MAX_COL + ref.col.number;
+}
+
+bool worksheet::recalculating() const noexcept {
+    return job_running;
+}
+
+void worksheet::wait_recalculation() {
+    cancel_recalculation();
+    start_recalculation(std::nullopt);
+    std::unique_lock<std::mutex> lock(worker_mutex);
+    worker_cv.wait(lock, [this]() { return !job_running; });
+}
+
+worksheet::~worksheet() {
+    cancel_recalculation();
+    {
+        std::lock_guard<std::mutex> lock(worker_mutex);
+        stopping = true;
+        worker_cv.notify_all();
+    }
+    if (worker.joinable()) worker.join();
+}
+
+namespace {
+    /**
+     * Range precedents of the cells of a job waiting for the cells of the job
+     * they cover to be finished.
+     *
+     * Each column holding cells of the job has a segment tree over their rows
+     * counting the unfinished ones, and a range waits on the O(log n) tree
+     * nodes covering its rows in each column. So finishing a cell costs
+     * O(log n) however many ranges cover it, and the cost of a running total
+     * column is linear in its edges instead of in the cells its ranges cover.
+     */
+    class range_waits {
+        public:
+            range_waits(const std::vector<worksheet::cell_reference>& cells) {
+                std::vector<int> order(cells.size());
+                for (int i=0; i<(int)cells.size(); ++i) order[i] = i;
+                std::sort(order.begin(), order.end(), [&](int a, int b) {
+                    return std::make_pair(cells[a].col.number, cells[a].row.number) < std::make_pair(cells[b].col.number, cells[b].row.number);
+                });
+                leaf_of.resize(cells.size());
+                for (int i : order) {
+                    if (columns.empty() || columns.back().col != cells[i].col.number) columns.push_back({ cells[i].col.number, {}, 0, {}, {} });
+                    leaf_of[i] = { (int)columns.size() - 1, (int)columns.back().rows.size() };
+                    columns.back().rows.push_back(cells[i].row.number);
+                }
+                for (column& c : columns) {
+                    c.size = 1;
+                    while (c.size < (int)c.rows.size()) c.size *= 2;
+                    c.unfinished.assign(2 * c.size, 0);
+                    c.first_wait.assign(2 * c.size, -1);
+                    for (int i=0; i<(int)c.rows.size(); ++i) c.unfinished[c.size + i] = 1;
+                    for (int node = c.size - 1; node >= 1; --node) c.unfinished[node] = c.unfinished[2*node] + c.unfinished[2*node + 1];
+                }
+            }
+
+            /**
+             * Make cell `dependent` wait for the cells of the job in `range`.
+             *
+             * @returns Whether there are any to wait for.
+             */
+            bool wait(const worksheet::range_reference& range, int dependent) {
+                const int id = ranges.size();
+                ranges.push_back({ dependent, 0 });
+                auto add = [&](column& c, int node) {
+                    if (c.unfinished[node] == 0) return;
+                    waits.push_back({ id, c.first_wait[node] });
+                    c.first_wait[node] = waits.size() - 1;
+                    ranges[id].remaining++;
+                };
+                auto it = std::lower_bound(columns.begin(), columns.end(), range.first.col.number, [](const column& c, int col) { return c.col < col; });
+                for (; it != columns.end() && it->col <= range.last.col.number; ++it) {
+                    int low = std::lower_bound(it->rows.begin(), it->rows.end(), range.first.row.number) - it->rows.begin() + it->size;
+                    int high = std::upper_bound(it->rows.begin(), it->rows.end(), range.last.row.number) - it->rows.begin() + it->size;
+                    for (; low < high; low /= 2, high /= 2) {
+                        if (low & 1) add(*it, low++);
+                        if (high & 1) add(*it, --high);
+                    }
+                }
+                if (ranges[id].remaining > 0) return true;
+                ranges.pop_back();
+                return false;
+            }
+
+            /**
+             * Mark cell `i` finished, calling `f(dependent)` for every range
+             * whose cells of the job are now all finished.
+             */
+            template<typename F>
+            void finish(int i, F f) {
+                column& c = columns[leaf_of[i].first];
+                for (int node = c.size + leaf_of[i].second; node >= 1; node /= 2) {
+                    if (--c.unfinished[node] != 0) continue;
+                    for (int w = c.first_wait[node]; w != -1; w = waits[w].next) {
+                        if (--ranges[waits[w].range].remaining == 0) f(ranges[waits[w].range].dependent);
+                    }
+                }
+            }
+        private:
+            struct column {
+                int col;
+                /// Rows of the cells of the job in the column, in order.
+                std::vector<int> rows;
+                /// Number of leaves of the tree, a power of two.
+                int size = 0;
+                /// Number of unfinished cells under each node of the tree, the root being node 1.
+                std::vector<int> unfinished;
+                /// First entry of `waits` for each node, or -1.
+                std::vector<int> first_wait;
+            };
+            struct range_wait {
+                int dependent;
+                /// Number of tree nodes waited on which still have unfinished cells.
+                int remaining;
+            };
+            /// A range waiting on a tree node, in a list per node.
+            struct wait_entry {
+                int range;
+                int next;
+            };
+            std::vector<column> columns;
+            /// Column and leaf of each cell.
+            std::vector<std::pair<int, int>> leaf_of;
+            std::vector<range_wait> ranges;
+            std::vector<wait_entry> waits;
+    };
+}
+
+void worksheet::calculate_levels(const std::vector<cell_reference>& dirty) {
+    // Count the edges coming from inside the dirty set. The other precedents
+    // are already finished and do not constrain the order, and dependents
+    // outside the set are left for a later job. A range precedent counts
+    // once, until every dirty cell it covers is finished.
+    std::unordered_map<int64_t, int> id;
+    id.reserve(dirty.size());
+    for (int i=0; i<(int)dirty.size(); ++i) id.emplace(cell_key(dirty[i]), i);
+    std::vector<int> in_degree(dirty.size(), 0);
+    range_waits waits(dirty);
+    for (int i=0; i<(int)dirty.size(); ++i) {
+        const cell* c = cells.find(dirty[i]);
+        for (const cell_reference& dependent : c->dependents) {
+            auto it = id.find(cell_key(dependent));
+            if (it != id.end()) in_degree[it->second]++;
+        }
+        for (const range_reference& range : c->range_precedents) {
+            if (waits.wait(range, i)) in_degree[i]++;
+        }
+    }
+
+    expression::context ctx(*this);
+    std::vector<int> level;
+    for (int i=0; i<(int)dirty.size(); ++i) {
+        if (in_degree[i] == 0) level.push_back(i);
+    }
+    // Below this many cells, starting threads costs more than it saves.
+    const size_t parallel_threshold = 1024;
+    const size_t chunk = 64;
+    while (!level.empty()) {
+        if (thread_count > 1 && level.size() >= parallel_threshold) {
+            std::atomic<size_t> next = 0;
+            auto work = [&]() {
+                expression::context ctx(*this);
+                for (size_t begin; !cancel_requested && (begin = next.fetch_add(chunk)) < level.size(); ) {
+                    for (size_t i = begin; i < std::min(begin + chunk, level.size()); ++i) calculate(dirty[level[i]], ctx);
+                }
+            };
+            std::vector<std::thread> threads;
+            for (unsigned int i=1; i<thread_count; ++i) threads.emplace_back(work);
+            work();
+            for (std::thread& thread : threads) thread.join();
+        } else {
+            for (int i : level) {
+                if (cancel_requested) break;
+                calculate(dirty[i], ctx);
+            }
+        }
+        if (cancel_requested) return;
+
+        std::vector<int> next_level;
+        auto release = [&](int dependent) {
+            if (--in_degree[dependent] == 0) next_level.push_back(dependent);
+        };
+        for (int i : level) {
+            for (const cell_reference& dependent : cells.find(dirty[i])->dependents) {
+                auto it = id.find(cell_key(dependent));
+                if (it != id.end()) release(it->second);
+            }
+            waits.finish(i, release);
+        }
+        level.swap(next_level);
+    }
+
+    std::vector<cell_reference> left;
+    for (const cell_reference& ref : dirty) {
+        if (cells.get_tile(ref).states[tile::index(ref)] == calculation_state_type::pending) left.push_back(ref);
+    }
+    if (!left.empty()) calculate_cycles(left);
+}
+
+void worksheet::calculate_cycles(const std::vector<cell_reference>& left) {
+    std::unordered_map<int64_t, int> id;
+    id.reserve(left.size());
+    for (int i=0; i<(int)left.size(); ++i) id.emplace(cell_key(left[i]), i);
+
+    // Edges from a cell to its dependents left too. Every cycle through a
+    // cell is left with it since the set is closed under pending precedents.
+    std::vector<std::vector<int>> edges(left.size());
+    std::vector<bool> self_loop(left.size(), false);
+    for (int i=0; i<(int)left.size(); ++i) {
+        for_each_dependent(left[i], [&](const cell_reference& dependent) {
+            auto found = id.find(cell_key(dependent));
+            if (found == id.end()) return;
+            int j = found->second;
+            if (j == i) self_loop[i] = true;
+            else edges[i].push_back(j);
+        });
+    }
+
+    // Iterative Tarjan's algorithm. Components are completed in reverse
+    // topological order.
+    const int unvisited = -1;
+    std::vector<int> order(left.size(), unvisited), low(left.size());
+    std::vector<bool> on_stack(left.size(), false);
+    std::vector<int> stack;
+    std::vector<std::vector<int>> components;
+    std::vector<std::pair<int, size_t>> frames;
+    int counter = 0;
+    for (int root=0; root<(int)left.size(); ++root) {
+        if (order[root] != unvisited) continue;
+        frames.push_back({ root, 0 });
+        order[root] = low[root] = counter++;
+        stack.push_back(root);
+        on_stack[root] = true;
+        while (!frames.empty()) {
+            auto& [v, next] = frames.back();
+            if (next < edges[v].size()) {
+                int w = edges[v][next++];
+                if (order[w] == unvisited) {
+                    order[w] = low[w] = counter++;
+                    stack.push_back(w);
+                    on_stack[w] = true;
+                    frames.push_back({ w, 0 });
+                } else if (on_stack[w]) {
+                    low[v] = std::min(low[v], order[w]);
+                }
+                continue;
+            }
+            if (low[v] == order[v]) {
+                components.emplace_back();
+                int w;
+                do {
+                    w = stack.back();
+                    stack.pop_back();
+                    on_stack[w] = false;
+                    components.back().push_back(w);
+                } while (w != v);
+            }
+            int finished = v;
+            frames.pop_back();
+            if (!frames.empty()) {
+                int parent = frames.back().first;
+                low[parent] = std::min(low[parent], low[finished]);
+            }
+        }
+    }
+
+    expression::context ctx(*this);
+    for (auto it = components.rbegin(); it != components.rend(); ++it) {
+        if (cancel_requested) return;
+        if (it->size() > 1 || self_loop[it->front()]) {
+            for (int i : *it) store(left[i], recur_error);
+        } else {
+            calculate(left[it->front()], ctx);
         }
     }
 }
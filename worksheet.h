@@ -4,37 +4,159 @@
 #include "terminal.h"
 #include "worksheet_reference.h"
 #include "expression.h"
+#include "bytecode.h"
 #include <iostream>
 #include <string>
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 class worksheet: public worksheet_reference {
     public:
-        static const int MAX_ROW = 100;
-        static const int MAX_COL = 100;
+        static const int MAX_ROW = 1 << 20;
+        static const int MAX_COL = 1 << 14;
+        /// Number of rows in a `tile`.
+        static const int TILE_ROWS = 1024;
+        /// Number of columns in a `tile`.
+        static const int TILE_COLS = 2;
+        /**
+         * Whether formulas are evaluated by running their bytecode instead of
+         * walking their expression tree.
+         */
+        static bool use_bytecode;
+        /**
+         * Number of threads calculating independent cells in parallel during
+         * recalculation, defaulting to the number of hardware threads.
+         */
+        static unsigned int thread_count;
         using worksheet_reference::reference;
         using worksheet_reference::half_reference;
         using worksheet_reference::row_reference;
         using worksheet_reference::col_reference;
         using worksheet_reference::cell_reference;
+        using worksheet_reference::range_reference;
+        enum struct calculation_state_type: uint8_t { pending, finished };
+        /**
+         * Cold data of a cell: its raw text, compiled formula and dependency
+         * edges. The calculated value is stored in its `tile`.
+         */
         struct cell {
             cell_reference ref;
             std::string raw;
-            enum struct calculation_state_type { pending, in_progress, finished } calculation_state;
-            bool needs_redraw = true;
+            /**
+             * Classification of the raw text, decided when the raw text is set.
+             */
+            enum struct kind_type { integer, text, formula } kind = kind_type::text;
+            /// Set by the recalculation thread and cleared when drawn.
+            std::atomic<bool> needs_redraw = true;
+            /**
+             * Compiled form of the raw text: the primitive itself for integers and
+             * texts, or the parsed expression for formulas.
+             */
             std::shared_ptr<const expression> expr;
-            std::shared_ptr<const expression::primitive> value;
-            cell(): ref(cell_reference(0, 0)), raw(""), expr(std::make_shared<const expression::text>("")), value(std::make_shared<expression::text>("")) {}
-            cell(cell_reference ref, std::string raw, std::shared_ptr<expression::primitive> value): ref(ref), raw(raw), expr(value), value(value) {};
-            
-            std::shared_ptr<const expression::primitive> calculate() noexcept(0);
+            /**
+             * `expr` compiled into bytecode, only set for formulas.
+             */
+            std::shared_ptr<const expression::bytecode> program;
+            /// Cells referenced by the formula of this cell.
+            std::vector<cell_reference> precedents;
+            /// Ranges referenced by the formula of this cell, each one a single edge.
+            std::vector<range_reference> range_precedents;
+            /// Cells whose formulas reference this cell.
+            std::vector<cell_reference> dependents;
+            /// An empty cell, sharing one empty text expression with the others.
+            cell(cell_reference ref): ref(ref), raw(""), expr(empty_text) {}
+            cell(cell_reference ref, std::string raw, std::shared_ptr<expression::primitive> value): ref(ref), raw(raw), expr(value) {};
+
+            /**
+             * Set the raw text of the cell, classifying and parsing it once.
+             *
+             * A raw text starting with an apostrophe is text without the
+             * apostrophe, to enter texts which look like integers or formulas.
+             *
+             * @throws expression::parse_exception Thrown if the raw text is a
+             *     formula which cannot be parsed.
+             * @exceptsafe Strong exception safety. The cell is only modified
+             *     after parsing succeeds.
+             */
+            void set_raw(const std::string& raw) noexcept(false);
+            /**
+             * Returns the text a raw text classified as text stands for.
+             */
+            static std::string text_of(const std::string& raw);
+            /**
+             * Returns a raw text standing for `text`, with an apostrophe if
+             * the text itself would be classified otherwise or lose an
+             * apostrophe.
+             */
+            static std::string raw_of_text(const std::string& text);
+
+            static const std::shared_ptr<const expression> empty_text;
+        };
+        /**
+         * A block of `TILE_ROWS` by `TILE_COLS` cells, allocated on the first
+         * write to any of them. Cells in tiles which were never allocated are
+         * empty.
+         *
+         * Calculated values are stored column-major in typed arrays so
+         * scanning a column walks memory sequentially: for each cell,
+         * `types` holds the type ID of the value and `data` the raw integer,
+         * boolean or error value, or for a text the index of the text in
+         * `texts`. Index 0 of `texts` is the shared empty text. The cold
+         * `cell` data is only allocated for cells which are written or
+         * referenced.
+         */
+        struct tile {
+            static const int SIZE = TILE_ROWS * TILE_COLS;
+            std::array<int64_t, SIZE> data;
+            std::array<int8_t, SIZE> types;
+            std::array<calculation_state_type, SIZE> states;
+            std::array<std::unique_ptr<cell>, SIZE> cells;
+            std::vector<std::string> texts = { "" };
+            /// Indices of `texts` which are no longer used.
+            std::vector<int64_t> free_texts;
+            /**
+             * Guards the values and states against the recalculation threads
+             * while they are read by the user interface.
+             */
+            mutable std::mutex mutex;
+
+            tile();
+
+            /**
+             * Index of a cell in the arrays of the tile containing it.
+             */
+            static int index(const cell_reference& ref) noexcept {
+                return (ref.col.number % TILE_COLS) * TILE_ROWS + ref.row.number % TILE_ROWS;
+            }
+
+            expression::value get(int index) const noexcept;
+            /// Store a calculated value and mark it finished.
+            void set(int index, const expression::value& value);
+            /// Returns whether the value is still to be recalculated.
+            bool stale(int index) const noexcept;
         };
     private:
-        std::array<int, MAX_COL> col_width;
-        std::array<int, MAX_ROW> row_height;
-        std::array<int, MAX_ROW> row_start;
-        std::array<int, MAX_ROW> col_start;
-        int header_col_width = 3;
+        /// Widths of the columns which do not have `default_col_width`.
+        std::unordered_map<int, int> col_widths;
+        /// Heights of the rows which do not have `default_row_height`.
+        std::unordered_map<int, int> row_heights;
+        /// Screen rows of the rows in the viewport, starting from `top_left`.
+        std::vector<int> row_starts;
+        /// Screen columns of the columns in the viewport, starting from `top_left`.
+        std::vector<int> col_starts;
+        int default_col_width = 10;
+        int default_row_height = 3;
+        int header_col_width = 7;
         int header_row_height = 2;
         const std::optional<terminal::rgb_color> border_color = {{50, 50, 50}};
         const std::optional<terminal::rgb_color> active_border_color = {{ 23, 88, 173 }};
@@ -42,37 +164,71 @@ class worksheet: public worksheet_reference {
         const std::optional<terminal::rgb_color> active_header_fg_color = {{ 255, 0, 0 }};
         const std::optional<terminal::rgb_color> header_fg_color = {{ 255, 255, 255 }};
         const std::optional<terminal::rgb_color> header_bg_color = {};
+        const std::optional<terminal::rgb_color> stale_fg_color = {{ 128, 128, 128 }};
+
+        int col_width(int col) const noexcept;
+        int row_height(int row) const noexcept;
+        /**
+         * Screen row of a row, or past the end of the screen if the row is
+         * not in the viewport.
+         */
+        int row_start(int row) const noexcept;
+        /**
+         * Screen column of a column, or past the end of the screen if the
+         * column is not in the viewport.
+         */
+        int col_start(int col) const noexcept;
     public:
         terminal::size bufsize;
+        /**
+         * Sparse storage of the cells, a directory of tiles indexed by column
+         * block and then row block.
+         */
         struct grid {
-            struct grid_row {
-                std::array<cell, MAX_COL> cells;
+            /// Tiles of each column block, empty until a tile in it is allocated.
+            std::array<std::vector<std::unique_ptr<tile>>, MAX_COL / TILE_COLS> tiles;
 
-                cell& operator[](const col_reference& col) {
-                    return cells[col.number];
-                }
-                cell& operator[](const int col) {
-                    return cells[col];
-                }
-            };
+            /**
+             * Get the tile containing a cell.
+             *
+             * @returns `nullptr` if the tile is not allocated or the cell is
+             *     outside the worksheet.
+             */
+            tile* find_tile(const cell_reference& ref) const noexcept;
+            /**
+             * Get the tile containing a cell, allocating it if needed. The
+             * cell must be inside the worksheet.
+             */
+            tile& get_tile(const cell_reference& ref);
+            /**
+             * Get a cell.
+             *
+             * @returns `nullptr` if the cell is empty and not referenced.
+             */
+            cell* find(const cell_reference& ref) const noexcept;
+            /**
+             * Get a cell, allocating it and its tile if needed. The cell must
+             * be inside the worksheet.
+             */
+            cell& operator[](const cell_reference& ref);
 
-            std::array<grid_row, MAX_ROW> cells;
-
-            grid_row& operator[](const int row) {
-                return cells[row];
-            }
-            grid_row& operator[](const row_reference& row) {
-                return cells[row.number];
-            }
-            cell& operator[](const cell_reference& ref) {
-                return (*this)[ref.row][ref.col];
+            /**
+             * Call `f(tile)` with every allocated tile.
+             */
+            template<typename F>
+            void for_each_tile(F f) const {
+                for (const auto& block : tiles) {
+                    for (const std::unique_ptr<tile>& t : block) {
+                        if (t) f(*t);
+                    }
+                }
             }
         };
         grid cells;
+        /// Top left cell of the viewport.
+        cell_reference top_left = cell_reference(0, 0);
         cell_reference active_cell = cell_reference(0, 0);
 
-        worksheet();
-
         void update_row_start();
         void update_col_start();
 
@@ -92,9 +248,266 @@ class worksheet: public worksheet_reference {
         void redraw();
 
         void update_active_cell(const cell_reference& oldValue, const cell_reference& newValue);
+        /**
+         * Draw the cells in the viewport whose values changed.
+         */
         void update_needs_redraw_cell();
+        /**
+         * Scroll the viewport so that a cell is visible.
+         *
+         * @returns Whether the viewport moved, so the worksheet must be redrawn.
+         */
+        bool scroll_to(const cell_reference& ref) noexcept;
+
+        /**
+         * Returns whether the reference lies inside the worksheet bounds.
+         */
+        static bool contains(const cell_reference& ref) noexcept;
 
+        ~worksheet();
+
+        /**
+         * Set the raw text of a cell, update the dependency graph and
+         * recalculate the cell together with its transitive dependents in
+         * the background.
+         *
+         * @throws expression::parse_exception Thrown if the raw text is a
+         *     formula which cannot be parsed. The worksheet is left unchanged.
+         */
+        void set_raw(const cell_reference& ref, const std::string& raw) noexcept(false);
+        /**
+         * Set the raw text of a cell and update the dependency graph without
+         * recalculating, to load many cells before a single `recalculate()`.
+         *
+         * @throws expression::parse_exception Thrown if the raw text is a
+         *     formula which cannot be parsed. The worksheet is left unchanged.
+         */
+        void load_raw(const cell_reference& ref, const std::string& raw) noexcept(false);
+        /**
+         * Put a cell whose raw text is already set at its `ref` and update
+         * the dependency graph without recalculating, like `load_raw`.
+         *
+         * Cells can be parsed on other threads this way before being loaded.
+         */
+        void load_cell(std::unique_ptr<cell> loaded);
+
+        /**
+         * Get the calculated value of a cell, which may be stale while it is
+         * recalculated.
+         */
+        expression::value value_at(const cell_reference& ref) const noexcept;
+        /**
+         * Returns whether the value of a cell is still to be recalculated.
+         */
+        bool is_stale(const cell_reference& ref) const noexcept;
+
+        /**
+         * Call `f(t, index, size)` with the runs of allocated tiles covering
+         * rows `first` to `last` of a column, in row order, where the run is
+         * `size` cells of `t` starting at `index`.
+         */
+        template<typename F>
+        void for_each_column_run(int col, int first, int last, F f) const {
+            for (int block = first / TILE_ROWS; block <= last / TILE_ROWS; ++block) {
+                const int begin = std::max(first, block * TILE_ROWS);
+                const int end = std::min(last, block * TILE_ROWS + TILE_ROWS - 1);
+                const cell_reference ref(begin, col);
+                if (tile* t = cells.find_tile(ref)) f(*t, tile::index(ref), end - begin + 1);
+            }
+        }
+
+        /**
+         * Recalculate every cell in the worksheet in the background.
+         */
         void recalculate();
+        /**
+         * Recalculate a cell and its transitive dependents in topological
+         * order in the background.
+         */
+        void recalculate(const cell_reference& changed);
+        /**
+         * Recalculate many changed cells and their transitive dependents in
+         * a single background job.
+         */
+        void recalculate(const std::vector<cell_reference>& changed);
+        /**
+         * Calculate the pending cells scrolled into view.
+         *
+         * Call after `update_row_start` and `update_col_start`. Does nothing
+         * unless the viewport changed since the last job started.
+         */
+        void calculate_visible();
+        /**
+         * Returns whether a recalculation is running in the background.
+         */
+        bool recalculating() const noexcept;
+        /**
+         * Called on the recalculation thread whenever a job ends, finished
+         * or cancelled, to wake up the user interface. Set it before the
+         * first recalculation.
+         */
+        std::function<void()> on_job_end;
+        /**
+         * Calculate every pending cell, including the ones deferred off
+         * screen, and wait for it to finish.
+         */
+        void wait_recalculation();
+    private:
+        /**
+         * Thread running recalculation jobs, started with the first job.
+         *
+         * A job only writes calculated values, under the `tile::mutex` of
+         * their tiles, so the user interface may keep reading the worksheet.
+         * Anything else modifying the worksheet cancels the job first.
+         */
+        std::thread worker;
+        /// Guards `job_running` and `stopping` changing hands.
+        std::mutex worker_mutex;
+        std::condition_variable worker_cv;
+        /**
+         * Keys of the pending cells, by `cell_key`. Finished cells are removed
+         * by the job calculating them.
+         */
+        std::unordered_set<int64_t> deferred;
+        /**
+         * Cells the current job calculates together with their pending
+         * precedents, usually the viewport. `std::nullopt` for every pending
+         * cell.
+         *
+         * Off-screen cells stay pending until they scroll into view or
+         * `wait_recalculation` needs them, so the time to show an edit
+         * depends on the viewport and not on the size of the worksheet.
+         */
+        std::optional<range_reference> job_targets;
+        std::atomic<bool> cancel_requested = false;
+        std::atomic<bool> job_running = false;
+        /// Set on destruction to end `worker`.
+        bool stopping = false;
+
+        /// Body of `worker`, running jobs until `stopping` is set.
+        void run_worker();
+
+        /**
+         * Cells in the viewport, or at least `top_left` when nothing fits.
+         */
+        range_reference visible_range() const noexcept;
+        /**
+         * Start calculating `targets` and their pending precedents in the
+         * background.
+         */
+        void start_recalculation(std::optional<range_reference> targets);
+        /**
+         * Stop the background recalculation, leaving its cells pending.
+         */
+        void cancel_recalculation();
+        /**
+         * Mark a cell and its transitive dependents pending and add them to
+         * `deferred`.
+         */
+        void mark_pending(const cell_reference& changed);
+        /**
+         * The pending cells a job calculates, closed under pending
+         * precedents.
+         */
+        std::vector<cell_reference> job_cells() const;
+        /// Key of a cell in `deferred` and in the maps of a job.
+        static int64_t cell_key(const cell_reference& ref) noexcept;
+
+        static const expression::value recur_error;
+
+        /**
+         * Calculate a pending cell from the values of its precedents, which
+         * must all be finished. Formulas only read the values of the cells
+         * they reference, so calculation never recurses.
+         *
+         * @param ctx Context of the calling thread, see `expression::context`.
+         */
+        void calculate(const cell_reference& ref, expression::context& ctx) noexcept;
+        /**
+         * Store the calculated value of a cell and mark it finished.
+         */
+        void store(const cell_reference& ref, const expression::value& value);
+
+        /**
+         * A range referenced by the formula of `dependent`.
+         */
+        struct range_edge {
+            range_reference range;
+            cell_reference dependent;
+        };
+        /// Number of rows of a single column in the smallest buckets of `range_dependents`.
+        static const int RANGE_BUCKET_ROWS = 64;
+        /// Number of sizes of the buckets of `range_dependents`, doubling up to a whole column.
+        static const int RANGE_BUCKET_LEVELS = 15;
+        /// Ranges listed under more buckets than this are kept in `large_range_dependents`.
+        static const int64_t MAX_INDEXED_BUCKETS = 4096;
+        /**
+         * Edges from ranges to the cells referencing them. The rows of a range
+         * in each column it covers are split into the fewest aligned buckets
+         * of `RANGE_BUCKET_ROWS << level` rows, as in a segment tree, and the
+         * edge is listed under each. So a range is listed under O(log n)
+         * buckets per column, and a changed cell only scans the ranges of the
+         * bucket around it of each size.
+         */
+        std::unordered_map<int64_t, std::vector<range_edge>> range_dependents;
+        /// Number of edges listed under buckets of each size, to skip the empty sizes.
+        int64_t level_edges[RANGE_BUCKET_LEVELS] = {};
+        /// Edges from ranges too large for `range_dependents`, scanned for every cell.
+        std::vector<range_edge> large_range_dependents;
+
+        /// Key of the bucket of `RANGE_BUCKET_ROWS << level` rows containing a cell in `range_dependents`.
+        static int64_t bucket_key(int level, int row, int col) noexcept;
+        /**
+         * Call `f(edges, level)` with the lists of edges a range is listed
+         * under, `level` being -1 for `large_range_dependents`.
+         */
+        template<typename F>
+        void for_each_range_list(const range_reference& range, F f);
+
+        /**
+         * Replace the precedents of a cell with the references in its formula,
+         * keeping the `dependents` of the referenced cells and
+         * `range_dependents` in sync.
+         */
+        void update_precedents(const cell_reference& ref);
+
+        /**
+         * Call `f` with every cell referencing `ref` directly or through a range.
+         * A cell is passed once per edge.
+         */
+        template<typename F>
+        void for_each_dependent(const cell_reference& ref, F f);
+
+        /**
+         * Calculate a set of pending cells, closed under pending precedents,
+         * one dependency level at a time. The cells of a level only reference
+         * cells of earlier levels or outside the set, so they are calculated
+         * in parallel when the level is large enough. The result is the same
+         * as calculating them one by one.
+         *
+         * A range precedent is counted as a single edge, released once the
+         * cells of the set it covers are finished, so the cost is linear in
+         * the edges rather than in the cells ranges cover.
+         *
+         * Cells left over are on or after a reference cycle and are passed to
+         * `calculate_cycles`. Returns early, leaving cells pending, once
+         * `cancel_requested` is set.
+         */
+        void calculate_levels(const std::vector<cell_reference>& dirty);
+        /**
+         * Calculate pending cells on or after reference cycles.
+         *
+         * The strongly connected components of the cells are found with an
+         * iterative Tarjan's algorithm, in linear time. Every cell in a
+         * component with a cycle is set to `#RECUR!` at once, and the others
+         * are calculated in topological order, so the error propagates to
+         * the cells after the cycles.
+         *
+         * Cycles are found from the references in the formulas and not from
+         * the values evaluation reads. So `=IF(TRUE,1,A1)` in `A1` is a cycle
+         * although the branch referencing `A1` is not taken.
+         */
+        void calculate_cycles(const std::vector<cell_reference>& cells);
 };
 
 #endif
@@ -1,5 +1,7 @@
 #include "worksheet_reference.h"
 #include <type_traits>
+#include <stdexcept>
+#include <algorithm>
 
 #define HALF_REFERENCE_RELATION_OP_IMPLEMENTATION(op) \
 template<typename T> \
@@ -33,11 +35,11 @@ T& worksheet_reference::half_reference<T>::operator ++() noexcept {
 }
 template<typename T>
 T worksheet_reference::half_reference<T>::operator -(int offset) const noexcept {
-    return *this + (-1);
+    return *this + (-offset);
 }
 template<typename T>
 T& worksheet_reference::half_reference<T>::operator -=(int offset) noexcept {
-    return *this += 1;
+    return *this += -offset;
 }
 template<typename T>
 T& worksheet_reference::half_reference<T>::operator --() noexcept {
@@ -73,7 +75,7 @@ std::string worksheet_reference::col_reference::to_code() const noexcept {
 worksheet_reference::col_reference worksheet_reference::col_reference::from_code(std::string code) noexcept(false) {
     if (code.length() == 0) throw std::invalid_argument("Empty code");
     int no = 0;
-    for (int i=0; i<code.length(); ++i) {
+    for (size_t i=0; i<code.length(); ++i) {
         if (code[i] >= 'a' && code[i] <= 'z') code[i] += 'A' - 'a';
         if (!(code[i] >= 'A' && code[i] <= 'Z')) throw std::invalid_argument("Expected letter");
         no = no * 26 + (code[i] - 'A' + 1);
@@ -89,7 +91,7 @@ worksheet_reference::cell_reference worksheet_reference::cell_reference::from_co
         throw std::invalid_argument("Missing column");
 
     int splitI = -1;
-    for (int i=0; i<code.length(); ++i) {
+    for (size_t i=0; i<code.length(); ++i) {
         if ((code[i] >= 'A' && code[i] <= 'Z') || (code[i] >= 'a' && code[i] <= 'z')) {
             continue;
         } else {
@@ -108,3 +110,19 @@ bool worksheet_reference::cell_reference::operator==(const cell_reference& other
 bool worksheet_reference::cell_reference::operator!=(const cell_reference& other) const noexcept {
     return !(*this == other);
 }
+
+worksheet_reference::range_reference::range_reference(const cell_reference& a, const cell_reference& b) noexcept:
+    first(std::min(a.row.number, b.row.number), std::min(a.col.number, b.col.number)),
+    last(std::max(a.row.number, b.row.number), std::max(a.col.number, b.col.number)) {}
+std::string worksheet_reference::range_reference::to_code() const noexcept {
+    return first.to_code() + ":" + last.to_code();
+}
+bool worksheet_reference::range_reference::contains(const cell_reference& ref) const noexcept {
+    return ref.row >= first.row && ref.row <= last.row && ref.col >= first.col && ref.col <= last.col;
+}
+bool worksheet_reference::range_reference::operator==(const range_reference& other) const noexcept {
+    return first == other.first && last == other.last;
+}
+bool worksheet_reference::range_reference::operator!=(const range_reference& other) const noexcept {
+    return !(*this == other);
+}
@@ -168,6 +168,37 @@ class worksheet_reference {
         bool operator==(const cell_reference& other) const noexcept;
         bool operator!=(const cell_reference& other) const noexcept;
     };
+    /**
+     * A reference to a rectangular range of cells, for example, A1:B100.
+     */
+    struct range_reference: reference {
+        /// The top left cell of the range.
+        cell_reference first;
+        /// The bottom right cell of the range.
+        cell_reference last;
+
+        /**
+         * Construct a `range_reference` with two opposite corners in any order.
+         *
+         * @param a One corner of the range.
+         * @param b The opposite corner of the range.
+         */
+        range_reference(const cell_reference& a, const cell_reference& b) noexcept;
+
+        /**
+         * Convert the range reference into the conventional "first:last"
+         * format, for example, A1:B100.
+         */
+        std::string to_code() const noexcept override;
+
+        /**
+         * Returns whether the cell lies inside the range.
+         */
+        bool contains(const cell_reference& ref) const noexcept;
+
+        bool operator==(const range_reference& other) const noexcept;
+        bool operator!=(const range_reference& other) const noexcept;
+    };
 };
 
 #endif
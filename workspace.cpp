@@ -1,5 +1,10 @@
 #include "workspace.h"
 #include "expression.h"
+#include "snapshot.h"
+#include <algorithm>
+#include <stdexcept>
+#include <system_error>
+#include <sys/stat.h>
 
 enum class workspace::mode_type: int {
     normal = 0,
@@ -12,27 +17,29 @@ const std::optional<terminal::rgb_color> workspace::error_color = {{255, 0, 0}};
 bool workspace::mark_flush = true;
 std::string workspace::insert_str;
 bool workspace::insert_parse_error = false;
+std::string workspace::path;
+std::string workspace::status;
+std::unique_ptr<journal> workspace::edits;
+const uint64_t workspace::min_compaction_size = 1 << 20;
 
 void workspace::render() {
+    // Lay out again for the new size, like ^L.
+    if (terminal::update_size()) mark_flush = true;
+    if (mark_flush) {
+        terminal::clear();
+        ws.bufsize = terminal::getSize() - terminal::size{ 1, 0 };
+    }
+
     ws.update_col_start();
     ws.update_row_start();
+    ws.calculate_visible();
 
     if (mark_flush) {
-        terminal::clear();
-        ws.bufsize = terminal::getSize() - terminal::size{ 1, 0 };
         ws.redraw();
         mark_flush = false;
     }
 
-    for (worksheet::row_reference r(0); r.number<worksheet::MAX_ROW; ++r) {
-        for (worksheet::col_reference c(0); c.number<worksheet::MAX_COL; ++c) {
-            worksheet::cell& cell = ws.cells[r][c];
-            if (cell.needs_redraw) {
-                ws.draw_cell_text(worksheet::cell_reference(r, c));
-                cell.needs_redraw = false;
-            }
-        }
-    }
+    ws.update_needs_redraw_cell();
 
     if (mode == mode_type::insert) {
         std::string message = "Edit " + ws.active_cell.to_code() + ": " + insert_str;
@@ -49,15 +56,30 @@ void workspace::render() {
     } else {
         terminal::cursor_pos = { 0, 0 };
         for (int i=0; i<terminal::getSize().col; ++i) {
-            terminal::set(terminal::getSize().row-1, i, ' ');
+            terminal::set(terminal::getSize().row-1, i, i < (int)status.length() ? status[i] : ' ');
+        }
+    }
+}
+
+void workspace::save() {
+    if (edits) {
+        try {
+            edits->commit();
+            struct stat st;
+            if (stat(path.c_str(), &st) == 0 && edits->size() < std::max<uint64_t>(min_compaction_size, st.st_size / 4)) return;
+        } catch (const std::system_error& e) {
+            // A journal which failed to write is started over by compacting.
         }
     }
+    const uint32_t generation = snapshot::save(ws, path);
+    if (edits) edits->reset(generation);
 }
 
 bool workspace::isWordChar(char c) {
     return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9');
 }
 void workspace::action(char ch) {
+    status = "";
     if (ch == '\x0C') { // ^L
         mark_flush = true;
     } else if (mode == mode_type::normal) {
@@ -69,14 +91,26 @@ void workspace::action(char ch) {
             else if (ch == 'h') offset = {0, -1};
 
             worksheet::cell_reference newValue(ws.active_cell.row + offset.first, ws.active_cell.col + offset.second);
-            if (newValue.col.number >= 0 && newValue.col.number < worksheet::MAX_COL && 
-                    newValue.row.number >= 0 && newValue.row.number < worksheet::MAX_ROW) {
-                ws.update_active_cell(ws.active_cell, newValue);
+            if (worksheet::contains(newValue)) {
+                if (ws.scroll_to(newValue)) mark_flush = true;
+                else ws.update_active_cell(ws.active_cell, newValue);
                 ws.active_cell = newValue;
             }
+        } else if (ch == 'w') {
+            if (path.empty()) {
+                status = "No file to write, pass a .sheet file";
+                return;
+            }
+            try {
+                save();
+                status = "Written " + path;
+            } catch (const std::exception& e) {
+                status = std::string("Cannot write ") + e.what();
+            }
         } else if (ch == 'i') {
             mode = mode_type::insert;
-            insert_str = ws.cells[ws.active_cell].raw;
+            const worksheet::cell* active = ws.cells.find(ws.active_cell);
+            insert_str = active ? active->raw : "";
         }
     } else {
         if (ch == '\x7F' || ch == '\x08') { // DEL, BS (^H)
@@ -89,18 +123,15 @@ void workspace::action(char ch) {
                 insert_str.pop_back();
             }
         } else if (ch == '\x0A') { // LF (^J, Enter)
-            if (insert_str.size() != 0 && insert_str[0] == '=') {
-                try {
-                    expression::parse(insert_str.substr(1, insert_str.length() - 1));
-                } catch (expression::parse_exception e) {
-                    insert_parse_error = true;
-                    return;
-                }
+            try {
+                ws.set_raw(ws.active_cell, insert_str);
+            } catch (const expression::parse_exception& e) {
+                insert_parse_error = true;
+                return;
             }
-            ws.cells[ws.active_cell].raw = insert_str;
+            if (edits) edits->append(ws.active_cell, insert_str);
             mode = mode_type::normal;
             insert_str = "";
-            ws.recalculate();
         } else if (ch == '\x1B') { // ESC (^[)
             mode = mode_type::normal;
             insert_str = "";
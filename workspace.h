@@ -2,6 +2,8 @@
 #define __INCLUDE_WORKSPACE_
 
 #include "worksheet.h"
+#include "journal.h"
+#include <memory>
 
 namespace workspace {
     enum struct mode_type: int;
@@ -14,8 +16,26 @@ namespace workspace {
     extern bool mark_flush;
     extern std::string insert_str;
     extern bool insert_parse_error;
+    /// Snapshot the worksheet is saved to with `w`, empty if none was given.
+    extern std::string path;
+    /// Message shown on the last row in normal mode until the next key.
+    extern std::string status;
+    /// Journal of the edits since the snapshot at `path` was written, if there is one.
+    extern std::unique_ptr<journal> edits;
+    /**
+     * Journals smaller than this many bytes, or a quarter of the snapshot, are
+     * not compacted by `save`.
+     */
+    extern const uint64_t min_compaction_size;
 
     void render();
+    /**
+     * Save the worksheet to `path`. This only syncs the journal of edits,
+     * unless it grew big enough to be compacted into a new snapshot.
+     *
+     * @throws std::system_error Thrown if the files cannot be written.
+     */
+    void save() noexcept(false);
 
     bool isWordChar(char c);
     void action(char ch);